@@ -1,9 +1,85 @@
 #include "SynthOX.h"
 #include <algorithm>
 #include <cmath>
+#include <type_traits>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SYNTHOX_HAS_SSE2
+#endif
 
 namespace SynthOX
 {
+#ifdef SYNTHOX_HAS_SSE2
+	namespace
+	{
+		inline __m128 Select(__m128 Mask, __m128 A, __m128 B) { return _mm_or_ps(_mm_and_ps(Mask, A), _mm_andnot_ps(Mask, B)); }
+
+		// floor of values in [0..2^31[
+		inline __m128 FloorPositive(__m128 x) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(x)); }
+
+		inline float HorizontalSum(__m128 x)
+		{
+			x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+			return _mm_cvtss_f32(_mm_add_ss(x, _mm_shuffle_ps(x, x, 1)));
+		}
+
+		//-----------------------------------------------------
+		// natural log of positive normal values, cephes logf
+		inline __m128 LogPS(__m128 x)
+		{
+			const __m128 One = _mm_set1_ps(1.f);
+			__m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(x), 23), _mm_set1_epi32(126)));
+			x = _mm_or_ps(_mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x007fffff))), _mm_set1_ps(.5f));
+
+			// mantissa in [sqrt(.5)..sqrt(2)[
+			const __m128 Low = _mm_cmplt_ps(x, _mm_set1_ps(.707106781f));
+			e = _mm_sub_ps(e, _mm_and_ps(Low, One));
+			x = _mm_sub_ps(_mm_add_ps(x, _mm_and_ps(Low, x)), One);
+
+			const __m128 z = _mm_mul_ps(x, x);
+			__m128 y = _mm_set1_ps(7.0376836292e-2f);
+			for(const float Coef : { -1.1514610310e-1f, 1.1676998740e-1f, -1.2420140846e-1f, 1.4249322787e-1f, -1.6668057665e-1f, 2.0000714765e-1f, -2.4999993993e-1f, 3.3333331174e-1f })
+				y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(Coef));
+
+			y = _mm_mul_ps(_mm_mul_ps(y, x), z);
+			y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(-2.12194440e-4f)));
+			y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(.5f)));
+			return _mm_add_ps(_mm_add_ps(x, y), _mm_mul_ps(e, _mm_set1_ps(.693359375f)));
+		}
+
+		//-----------------------------------------------------
+		// exp clamped to the normal range, cephes expf
+		inline __m128 ExpPS(__m128 x)
+		{
+			const __m128 One = _mm_set1_ps(1.f);
+			x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.3f)), _mm_set1_ps(88.3f));
+
+			__m128 n = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(.5f));
+			const __m128 Trunc = _mm_cvtepi32_ps(_mm_cvttps_epi32(n));
+			n = _mm_sub_ps(Trunc, _mm_and_ps(_mm_cmpgt_ps(Trunc, n), One));
+
+			x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(.693359375f)));
+			x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+
+			__m128 y = _mm_set1_ps(1.9875691500e-4f);
+			for(const float Coef : { 1.3981999507e-3f, 8.3334519073e-3f, 4.1665795894e-2f, 1.6666665459e-1f, 5.0000001201e-1f })
+				y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(Coef));
+
+			y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(x, x)), x), One);
+			const __m128i Scale = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127)), 23);
+			return _mm_mul_ps(y, _mm_castsi128_ps(Scale));
+		}
+
+		//-----------------------------------------------------
+		// x^Exponent for x >= 0, Pow0 being 0^Exponent
+		inline __m128 PowPS(__m128 x, float Exponent, __m128 Pow0)
+		{
+			const __m128 Val = ExpPS(_mm_mul_ps(LogPS(_mm_max_ps(x, _mm_set1_ps(std::numeric_limits<float>::min()))), _mm_set1_ps(Exponent)));
+			return Select(_mm_cmpgt_ps(x, _mm_setzero_ps()), Val, Pow0);
+		}
+	};
+#endif
 
 	//-----------------------------------------------------
 	AnalogSource::AnalogSource(StereoSoundBuf * Dest, int Channel, AnalogSourceData * Data) : 
@@ -18,16 +94,55 @@ namespace SynthOX
 
 		for(auto & Note : m_NoteTab)
 		{
-			for(int i = 0; i < AnalogsourceOscillatorNr; i++)
-			{
-				for(int j = 0; j < int(LFODest::Max); j++)
-					Note.m_OscillatorTab[i].m_LFOTab[j].m_Data = &m_Data->m_OscillatorTab[i].m_LFOTab[j];
+			Note.Reset();
+			BindNoteData(Note);
+		}
+	}
 
-				Note.m_OscillatorTab[i].m_LFOTab[int(LFODest::Tune)].m_ZeroCentered = true;
-			}
+	//-----------------------------------------------------
+	void AnalogSource::BindNoteData(AnalogSourceNote & Note)
+	{
+		for(int i = 0; i < AnalogsourceOscillatorNr; i++)
+		{
+			for(int j = 0; j < int(LFODest::Max); j++)
+				Note.m_OscillatorTab[i].m_LFOTab[j].m_Data = &m_Data->m_OscillatorTab[i].m_LFOTab[j];
+
+			Note.m_OscillatorTab[i].m_LFOTab[int(LFODest::Tune)].m_ZeroCentered = true;
 		}
 	}
 
+	//-----------------------------------------------------
+	void AnalogSource::SaveRenderState(RenderState & State) const
+	{
+		static_assert(std::is_trivially_copyable_v<RenderState>, "render states are stored as raw bytes");
+
+		std::copy(std::begin(m_NoteTab), std::end(m_NoteTab), std::begin(State.m_NoteTab));
+		State.m_PortamentoBaseNote = m_PortamentoBaseNote;
+		State.m_PortamentoStep = m_PortamentoStep;
+		State.m_ArpeggioIdx = m_ArpeggioIdx;
+		State.m_ArpeggioTime = m_ArpeggioTime;
+	}
+
+	//-----------------------------------------------------
+	void AnalogSource::LoadRenderState(const RenderState & State)
+	{
+		// the state may come from another process : its pointers are rebuilt, its voices render live
+		for(int i = 0; i < AnalogsourcePolyphonyNoteNr; i++)
+		{
+			auto & Note = m_NoteTab[i];
+			Note = State.m_NoteTab[i];
+			Note.m_CacheEntry = nullptr;
+			Note.m_CacheIdx = 0;
+			Note.m_CacheRecording = false;
+			BindNoteData(Note);
+		}
+
+		m_PortamentoBaseNote = State.m_PortamentoBaseNote;
+		m_PortamentoStep = State.m_PortamentoStep;
+		m_ArpeggioIdx = State.m_ArpeggioIdx;
+		m_ArpeggioTime = State.m_ArpeggioTime;
+	}
+
 	//-----------------------------------------------------
 	void AnalogSource::NoteOn(int KeyId, float Velocity)
 	{	
@@ -36,8 +151,15 @@ namespace SynthOX
 			for(auto & Osc : Note.m_OscillatorTab)
 				for(auto & LFO : Osc.m_LFOTab)
 					LFO.NoteOn();
+
+			// the note time restarts : so does the modulation block
+			Note.m_ModulationPos = 0;
 		};
 
+		// the governor rates voices at block start, before the sample loop updates their loudness :
+		// a fresh note is rated at its envelope peak rather than at its old release level
+		const float PeakLoudness = Velocity * std::max(m_Data->m_LeftVolume, m_Data->m_RightVolume);
+
 		if(m_Data->m_PolyphonyMode == PolyphonyMode::Portamento)
 		{
 			if(m_NoteTab[0].m_NoteOn)
@@ -50,22 +172,36 @@ namespace SynthOX
 			{
 				m_PortamentoBaseNote = float(KeyId);
 				m_PortamentoStep = 0.0f;
+				m_NoteTab[0].RestartPitch();
 			}
 
 			m_NoteTab[0].NoteOn(KeyId, Velocity);
+			m_NoteTab[0].m_Loudness = PeakLoudness;
 			LFONoteOn(m_NoteTab[0]);
 		}
 		else
 		{
+			auto TriggerNote = [&](AnalogSourceNote & Note)
+			{
+				Note.m_AmpADSRValue = GetADSRValue(Note, Note.m_AmpADSRValue, m_Data->m_AmpADSR);
+				Note.m_FilterADSRValue = GetADSRValue(Note, Note.m_FilterADSRValue, m_Data->m_FilterADSR);
+				const bool bRestart = !Note.m_NoteOn;
+				Note.NoteOn(KeyId, Velocity);
+				Note.m_Loudness = PeakLoudness;
+				LFONoteOn(Note);
+				if(bRestart)
+				{
+					Note.RestartPitch();
+					AttachNoteCache(Note);
+				}
+			};
+
 			bool bFound = false;
 			for(auto & Note : m_NoteTab)
 			{
 				if(Note.m_Code == KeyId)
 				{
-					Note.m_AmpADSRValue = GetADSRValue(Note, Note.m_AmpADSRValue, m_Data->m_AmpADSR);
-					Note.m_FilterADSRValue = GetADSRValue(Note, Note.m_FilterADSRValue, m_Data->m_FilterADSR);;
-					Note.NoteOn(KeyId, Velocity);
-					LFONoteOn(Note);
+					TriggerNote(Note);
 					bFound = true;
 					break;
 				}
@@ -77,10 +213,7 @@ namespace SynthOX
 				{
 					if(Note.m_Died)
 					{
-						Note.m_AmpADSRValue = GetADSRValue(Note, Note.m_AmpADSRValue, m_Data->m_AmpADSR);
-						Note.m_FilterADSRValue = GetADSRValue(Note, Note.m_FilterADSRValue, m_Data->m_FilterADSR);;
-						Note.NoteOn(KeyId, Velocity);
-						LFONoteOn(Note);
+						TriggerNote(Note);
 						bFound = true;
 						break;
 					}
@@ -93,10 +226,7 @@ namespace SynthOX
 				{
 					if(!Note.m_NoteOn)
 					{
-						Note.m_AmpADSRValue = GetADSRValue(Note, Note.m_AmpADSRValue, m_Data->m_AmpADSR);
-						Note.m_FilterADSRValue = GetADSRValue(Note, Note.m_FilterADSRValue, m_Data->m_FilterADSR);;
-						Note.NoteOn(KeyId, Velocity);
-						LFONoteOn(Note);
+						TriggerNote(Note);
 						bFound = true;
 						break;
 					}
@@ -114,6 +244,7 @@ namespace SynthOX
 			{
 				Note.m_AmpADSRValue = GetADSRValue(Note, Note.m_AmpADSRValue, m_Data->m_AmpADSR);
 				Note.m_FilterADSRValue = GetADSRValue(Note, Note.m_FilterADSRValue, m_Data->m_FilterADSR);;
+				DetachNoteCache(Note, Note.m_AmpADSRValue != 0.f); // no need to resume a silent voice
 				Note.NoteOff();
 				break;
 			}
@@ -156,16 +287,200 @@ namespace SynthOX
 		}
 	}
 
-	inline float Transfer(float x, float Alpha)
+	//-----------------------------------------------------
+	void AnalogSource::VoiceState::Reset()
 	{
-		return x < .5f ? .5f - .5f * std::powf(1.f - 2.f*x, Alpha) : .5f + .5f * std::powf(2.f*x - 1.f, Alpha);
+		for(auto & Oscillator : m_OscillatorTab)
+		{
+			Oscillator.m_Cursor = 0.f;
+
+			// spread the unison copies' phases so they don't start in sync
+			for(int k = 0; k < UnisonMaxNr; k++)
+				Oscillator.m_UnisonCursorTab[k] = std::fmod(float(k) * .618034f, 1.f);
+		}
+
+		m_ModulationPos = 0;
+		RestartPitch();
+		ClearTails();
+	}
+
+	//-----------------------------------------------------
+	void AnalogSource::VoiceState::RestartPitch()
+	{
+		m_PitchRampPos = 0;
+		m_bPitchSnap = true;
+	}
+
+	//-----------------------------------------------------
+	void AnalogSource::VoiceState::ClearTails()
+	{
+		for(auto & Oscillator : m_OscillatorTab)
+		{
+			Oscillator.m_PrevVal = 0.f;
+			Oscillator.m_PrevValR = 0.f;
+		}
+
+		m_Filter = {};
+		m_SideFilter = {};
+	}
+
+	//-----------------------------------------------------
+	int AnalogSource::LadderState::FlushDenormals(bool bFlush)
+	{
+		int SubnormalNr = 0;
+		for(float * Val : { &az1, &az2, &az3, &az4, &az5, &ay1, &ay2, &ay3, &ay4, &amf })
+			SubnormalNr += FlushDenormal(*Val, bFlush);
+
+		return SubnormalNr;
+	}
+
+	//-----------------------------------------------------
+	int AnalogSource::VoiceState::FlushDenormals(bool bFlush)
+	{
+		int SubnormalNr = 0;
+		for(auto & Oscillator : m_OscillatorTab)
+			SubnormalNr += FlushDenormal(Oscillator.m_PrevVal, bFlush) + FlushDenormal(Oscillator.m_PrevValR, bFlush);
+
+		return SubnormalNr + m_Filter.FlushDenormals(bFlush) + m_SideFilter.FlushDenormals(bFlush);
+	}
+
+	//-----------------------------------------------------
+	void AnalogSource::UpdateUnisonLanes()
+	{
+		m_bStereoVoices = false;
+		for(int j = 0; j < AnalogsourceOscillatorNr; j++)
+		{
+			const auto & OscillatorData = m_Data->m_OscillatorTab[j];
+			auto & Lanes = m_UnisonTab[j];
+
+			const int Nr = std::clamp(int(OscillatorData.m_UnisonNr), 1, UnisonMaxNr);
+			const float Spread = std::clamp(OscillatorData.m_UnisonSpread, 0.f, 1.f);
+			if(Nr != Lanes.m_DataNr || OscillatorData.m_UnisonDetune != Lanes.m_DataDetune || Spread != Lanes.m_DataSpread)
+				BuildUnisonLanes(Lanes, Nr, OscillatorData.m_UnisonDetune, Spread);
+
+			m_bStereoVoices |= Lanes.m_bStereo;
+		}
+	}
+
+	//-----------------------------------------------------
+	void AnalogSource::BuildUnisonLanes(UnisonLanes & Lanes, int Nr, float Detune, float Spread)
+	{
+		Lanes.m_DataNr = Nr;
+		Lanes.m_DataDetune = Detune;
+		Lanes.m_DataSpread = Spread;
+
+		Lanes.m_Nr = Nr;
+		Lanes.m_Norm = 1.f / std::sqrt(float(Nr));
+		Lanes.m_bStereo = Nr > 1 && Spread != 0.f;
+
+		for(int k = 0; k < UnisonMaxNr; k++)
+		{
+			// copies evenly placed in [-1..1] for detune and panning
+			const float Pos = Nr > 1 ? 2.f * float(k) / float(Nr - 1) - 1.f : 0.f;
+			const float Pan = Pos * Spread;
+			Lanes.m_RatioTab[k] = std::pow(2.f, Pos * Detune / 12.f);
+			Lanes.m_LeftGainTab[k] = k < Nr ? std::min(1.f - Pan, 1.f) : 0.f;
+			Lanes.m_RightGainTab[k] = k < Nr ? std::min(1.f + Pan, 1.f) : 0.f;
+		}
+	}
+
+	//-----------------------------------------------------
+	// shapes and advances the copies of a unison stack, returns the left and right sums
+	std::pair<float, float> AnalogSource::RenderUnisonLanes(OscillatorTransients & Oscillator, const UnisonLanes & Lanes, bool bCheapWaveform) const
+	{
+		const float Decat = Oscillator.m_Decat;
+		const bool bDecat = Decat <= 1000.f;
+		const float DistortGain = Oscillator.m_DistortGain;
+		const float C = Oscillator.m_ShapeC;
+		const float Flatness = Oscillator.m_Flatness;
+		const float FreqInc = Oscillator.m_FreqInc;
+		const float ShiftInc = Oscillator.m_ShiftInc;
+		const int LaneNr = Lanes.m_Nr;
+		float * CursorTab = Oscillator.m_UnisonCursorTab;
+
+#ifdef SYNTHOX_HAS_SSE2
+		// 4 copies per step, the lanes past LaneNr have null gains
+		const __m128 One = _mm_set1_ps(1.f);
+		const __m128 Half = _mm_set1_ps(.5f);
+		const __m128 SignMask = _mm_set1_ps(-0.f);
+		const __m128 DecatV = _mm_set1_ps(Decat);
+		const __m128 DecatOffset = _mm_set1_ps(.5f / Decat);
+		const __m128 Gain = _mm_set1_ps(1.f + DistortGain);
+		const __m128 ShapePow0 = _mm_set1_ps(std::powf(0.f, C));
+		const __m128 FlatPow0 = _mm_set1_ps(std::powf(0.f, Flatness));
+		const __m128 FreqIncV = _mm_set1_ps(FreqInc);
+		const __m128 ShiftIncV = _mm_set1_ps(ShiftInc);
+
+		__m128 SumL = _mm_setzero_ps();
+		__m128 SumR = _mm_setzero_ps();
+		for(int k = 0; k < LaneNr; k += 4)
+		{
+			const __m128 Phase = _mm_loadu_ps(CursorTab + k);
+			const __m128 Cursor = bDecat ? _mm_add_ps(_mm_div_ps(FloorPositive(_mm_mul_ps(Phase, DecatV)), DecatV), DecatOffset) : Phase;
+			const __m128 bLow = _mm_cmplt_ps(Cursor, Half);
+			const __m128 Fold = Select(bLow, Cursor, _mm_sub_ps(One, Cursor));
+
+			__m128 Val;
+			if(bCheapWaveform)
+			{
+				Val = _mm_sub_ps(One, _mm_add_ps(Fold, Fold));
+			}
+			else
+			{
+				// Transfer, its two halves mirrored around .5
+				const __m128 x = PowPS(_mm_add_ps(Fold, Fold), C, ShapePow0);
+				const __m128 Bend = _mm_mul_ps(Half, PowPS(_mm_andnot_ps(SignMask, _mm_sub_ps(_mm_add_ps(x, x), One)), Flatness, FlatPow0));
+				Val = _mm_sub_ps(One, Select(_mm_cmplt_ps(x, Half), _mm_sub_ps(Half, Bend), _mm_add_ps(Half, Bend)));
+			}
+
+			// odd half of the period, then Distortion
+			Val = _mm_xor_ps(Val, _mm_andnot_ps(bLow, SignMask));
+			Val = _mm_mul_ps(Val, Gain);
+			Val = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(1.5f), Val), _mm_mul_ps(_mm_mul_ps(Half, Val), _mm_mul_ps(Val, Val)));
+
+			SumL = _mm_add_ps(SumL, _mm_mul_ps(Val, _mm_loadu_ps(Lanes.m_LeftGainTab + k)));
+			SumR = _mm_add_ps(SumR, _mm_mul_ps(Val, _mm_loadu_ps(Lanes.m_RightGainTab + k)));
+
+			// cursors are never negative, the floor is a truncation
+			const __m128 Next = _mm_add_ps(Phase, _mm_max_ps(_mm_add_ps(_mm_mul_ps(FreqIncV, _mm_loadu_ps(Lanes.m_RatioTab + k)), ShiftIncV), _mm_setzero_ps()));
+			_mm_storeu_ps(CursorTab + k, _mm_sub_ps(Next, FloorPositive(Next)));
+		}
+
+		return { HorizontalSum(SumL), HorizontalSum(SumR) };
+#else
+		float SumL = 0.f;
+		float SumR = 0.f;
+		for(int k = 0; k < LaneNr; k++)
+		{
+			const float Cursor = bDecat ? (std::floor(CursorTab[k] * Decat) / Decat) + .5f / Decat : CursorTab[k];
+			const float Fold = Cursor < .5f ? Cursor : 1.f - Cursor;
+			const float Shape = bCheapWaveform ? 1.f - 2.f * Fold : 1.f - Transfer(std::powf(Fold * 2.f, C), Flatness);
+			const float Val = Distortion(DistortGain, Cursor < .5f ? Shape : -Shape);
+			SumL += Val * Lanes.m_LeftGainTab[k];
+			SumR += Val * Lanes.m_RightGainTab[k];
+
+			const float Next = CursorTab[k] + std::max(FreqInc * Lanes.m_RatioTab[k] + ShiftInc, 0.f);
+			CursorTab[k] = Next - std::floor(Next);
+		}
+
+		return { SumL, SumR };
+#endif
 	}
 
 //-----------------------------------------------------
 	std::vector<float> AnalogSource::RenderScope(int OscIdx, unsigned int NbSamples)
 	{
-		std::vector<float> Ret;
-		Ret.reserve(NbSamples);
+		SYNTHOX_RT_FORBIDDEN();
+
+		std::vector<float> Ret(NbSamples);
+		RenderScope(OscIdx, Ret);
+		return Ret;
+	}
+
+//-----------------------------------------------------
+	void AnalogSource::RenderScope(int OscIdx, std::span<float> Dest)
+	{
+		const size_t NbSamples = Dest.size();
 
 		auto & Oscillator = m_NoteTab[0].m_OscillatorTab[OscIdx];
 
@@ -177,23 +492,212 @@ namespace SynthOX
         const float Flatness = std::powf(Oscillator.m_LFOTab[int(LFODest::Squish)].m_Data->m_BaseValue, 3.f) * 8.f;
 
 		const float step = 1.f / NbSamples;
-		for(unsigned int i = 0; i < NbSamples; i++)
+		for(size_t i = 0; i < NbSamples; i++)
 		{
 			const float Decat = std::ceilf(1.f + 1.f / (std::powf(Oscillator.m_LFOTab[int(LFODest::Decat)].m_Data->m_BaseValue, 3.f) + .001f));
 			const float Cursor = (std::floor(step * (i+1) * Decat) / Decat) + .5f / Decat;
 			auto Val = [Flatness, C](float c) -> float { return 1.f - Transfer(std::powf(c * 2.f, C), Flatness); };
 			const float val = Cursor < .5f ? Val(Cursor) : -Val(1.f - Cursor);
-			Ret.push_back(Distortion(Oscillator.m_LFOTab[int(LFODest::Distort)].m_Data->m_BaseValue, val));
+			Dest[i] = Distortion(Oscillator.m_LFOTab[int(LFODest::Distort)].m_Data->m_BaseValue, val);
 		}
-
-		return Ret;
 	}
 	
+//-----------------------------------------------------
+	void AnalogSource::RenderLFOScope(int OscIdx, LFODest LFO, std::span<float> Dest) const
+	{
+		// one period around the base value, random LFOs have no shape to show
+		const auto & Data = m_Data->m_OscillatorTab[OscIdx].m_LFOTab[int(LFO)];
+		if(Data.m_WF == WaveType::Rand || Dest.empty())
+		{
+			std::fill(Dest.begin(), Dest.end(), Data.m_BaseValue);
+			return;
+		}
+
+		FillWaveform(Data.m_WF, 0.f, 1.f / float(Dest.size()), Dest);
+		for(auto & Val : Dest)
+			Val = (Val * Data.m_Magnitude + 1.f) * Data.m_BaseValue;
+	}
+
+//-----------------------------------------------------
+	void AnalogSource::UpdatePitchRamp(AnalogSourceNote & Note, float TargetNote)
+	{
+		// TargetNote is the pitch expected PitchRampLength samples ahead. The note increment moves there
+		// by a constant ratio, a linear ramp in log-frequency, so that per sample pitch tracking is a single
+		// multiply. The Tune LFO shift is in Hz and ramps linearly.
+		static const float RampTime = float(PitchRampLength) / PlaybackFreq;
+
+		for(int j = 0; j < AnalogsourceOscillatorNr; j++)
+		{
+			auto & Oscillator = Note.m_OscillatorTab[j];
+			const auto & OscillatorData = m_Data->m_OscillatorTab[j];
+
+			const float Offset = float(OscillatorData.m_NoteOffset) + 12.f * float(OscillatorData.m_OctaveOffset);
+			const float FreqInc = GetNoteFreq(TargetNote + Offset) / PlaybackFreq;
+			const float ShiftInc = Oscillator.m_LFOTab[int(LFODest::Tune)].GetUpdatedValue(Note.m_Time + RampTime, PitchRampLength) / PlaybackFreq;
+
+			if(Note.m_bPitchSnap || Oscillator.m_FreqInc <= 0.f)
+			{
+				Oscillator.m_FreqInc = FreqInc;
+				Oscillator.m_ShiftInc = ShiftInc;
+				Oscillator.m_FreqIncRatio = 1.f;
+				Oscillator.m_ShiftIncStep = 0.f;
+			}
+			else
+			{
+				Oscillator.m_FreqIncRatio = FreqInc == Oscillator.m_FreqInc ? 1.f : std::pow(FreqInc / Oscillator.m_FreqInc, 1.f / PitchRampLength);
+				Oscillator.m_ShiftIncStep = (ShiftInc - Oscillator.m_ShiftInc) / PitchRampLength;
+			}
+		}
+
+		Note.m_bPitchSnap = false;
+	}
+
+//-----------------------------------------------------
+	std::pair<float, float> AnalogSource::RenderVoice(AnalogSourceNote & Note, float BaseNote)
+	{
+		float NoteOutput = 0.0f;
+		float NoteOutputR = 0.0f;
+
+		if(Note.m_PitchRampPos == 0)
+			UpdatePitchRamp(Note, BaseNote);
+		Note.m_PitchRampPos = (Note.m_PitchRampPos + 1) % PitchRampLength;
+
+		// LFOs are filled a block ahead, at the modulation rate the governor allows when the block starts
+		static_assert(int(LFODest::Tune) == 0 && ModulationBlockLength % ModulationDecimation == 0);
+		if(Note.m_ModulationPos == 0)
+		{
+			Note.m_ModulationStep = Note.m_Quality >= VoiceQuality::CoarseModulation ? ModulationDecimation : 1;
+			const int ValueNr = ModulationBlockLength / Note.m_ModulationStep;
+
+			for(auto & Oscillator : Note.m_OscillatorTab)
+				for(int k = int(LFODest::Tune) + 1; k < int(LFODest::Max); k++)
+					Oscillator.m_LFOTab[k].GetUpdatedValues(Note.m_Time, std::span<float>(Oscillator.m_LFOBlock[k - 1], ValueNr), Note.m_ModulationStep);
+		}
+
+		const bool bUpdateModulation = Note.m_ModulationPos % Note.m_ModulationStep == 0;
+		const int ModulationIdx = Note.m_ModulationPos / Note.m_ModulationStep;
+		Note.m_ModulationPos = (Note.m_ModulationPos + 1) % ModulationBlockLength;
+
+		// governor degradations
+		const bool bCheapWaveform = Note.m_Quality >= VoiceQuality::CheapWaveform;
+
+		// update Oscillators
+		for(int j = 0; j < AnalogsourceOscillatorNr; j++)
+		{
+			auto & Oscillator = Note.m_OscillatorTab[j];
+			const auto & OscillatorData = m_Data->m_OscillatorTab[j];
+			const auto & Lanes = m_UnisonTab[j];
+
+			if(bUpdateModulation)
+			{
+				auto LFOVal = [&Oscillator, ModulationIdx](LFODest LFODest) -> float { return Oscillator.m_LFOBlock[int(LFODest) - 1][ModulationIdx]; };
+				Oscillator.m_Volume		= std::max(LFOVal(LFODest::Volume ), 0.f);
+				const float Morph		= LFOVal(LFODest::Morph  );
+				const float Squish		= LFOVal(LFODest::Squish );
+				Oscillator.m_DistortGain= LFOVal(LFODest::Distort);
+				const float Decat		= LFOVal(LFODest::Decat  );
+			
+				const float Alpha = .4f + .6f * std::clamp(Morph, 0.f, 1.f);
+				Oscillator.m_ShapeC = std::powf(Alpha, 10.f) * 30.f;
+				Oscillator.m_Flatness = Squish*Squish*Squish * 8.f;
+				Oscillator.m_Decat = std::ceilf(1.f + (1.f / (Decat*Decat*Decat + .001f)));
+			}
+
+			const float Volume = Oscillator.m_Volume;
+			const float DistortGain = Oscillator.m_DistortGain;
+			const float Decat = Oscillator.m_Decat;
+			auto GetVal = [Flatness = Oscillator.m_Flatness, C = Oscillator.m_ShapeC, bCheapWaveform](float c) -> float
+			{
+				return bCheapWaveform ? 1.f - 2.f * c : 1.f - Transfer(std::powf(c * 2.f, C), Flatness);
+			};
+
+			float val, valR;
+			if(Lanes.m_Nr == 1)
+			{
+				const float Cursor = Decat > 1000.f ? Oscillator.m_Cursor : (std::floor(Oscillator.m_Cursor * Decat) / Decat) + .5f / Decat;
+				val = Cursor < .5f ? GetVal(Cursor) : -GetVal(1.f - Cursor);
+				val = Distortion(DistortGain, val) * Volume;
+
+				val = std::lerp(Oscillator.m_PrevVal, val, .4f);
+				Oscillator.m_PrevVal = val;
+				valR = val;
+
+				// avance le curseur de lecture de l'oscillateur
+				Oscillator.m_Cursor += std::max(Oscillator.m_FreqInc + Oscillator.m_ShiftInc, 0.f);
+				Oscillator.m_Cursor -= std::floorf(Oscillator.m_Cursor);
+			}
+			else
+			{
+				// unison stack : the copies share this oscillator's modulation, only phase and pan differ
+				const auto [SumL, SumR] = RenderUnisonLanes(Oscillator, Lanes, bCheapWaveform);
+
+				// the smoothing is linear, applying it on the sum is the same as per copy
+				val = std::lerp(Oscillator.m_PrevVal, SumL * Lanes.m_Norm * Volume, .4f);
+				valR = std::lerp(Oscillator.m_PrevValR, SumR * Lanes.m_Norm * Volume, .4f);
+				Oscillator.m_PrevVal = val;
+				Oscillator.m_PrevValR = valR;
+			}
+
+			Oscillator.m_FreqInc *= Oscillator.m_FreqIncRatio;
+			Oscillator.m_ShiftInc += Oscillator.m_ShiftIncStep;
+
+			const float ModDepth = Oscillator.m_LFOTab[int(LFODest::Volume)].m_Data->m_BaseValue;
+			switch(OscillatorData.m_ModulationType)
+			{
+			case ModulationType::Mix:	NoteOutput += val;	NoteOutputR += valR;	break;
+			case ModulationType::Mul:	NoteOutput *= std::lerp(1.f, val, ModDepth);	NoteOutputR *= std::lerp(1.f, valR, ModDepth);	break;
+			case ModulationType::Ring:	NoteOutput *= 1.0f - 0.5f*(val+Volume);	NoteOutputR *= 1.0f - 0.5f*(valR+Volume);	break; // ???
+			}
+		}
+
+		const int PassNr = Note.m_Quality >= VoiceQuality::SinglePassFilter ? 1 : 2;
+		const float FilterADSR = GetADSRValue(Note, Note.m_FilterADSRValue, m_Data->m_FilterADSR);
+		const float FilterMix = m_Data->m_FilterDrive * (m_Data->m_InvFilterEnv ? FilterADSR : 1.f - FilterADSR);
+		const float Cutoff = m_Data->m_FilterFreq*m_Data->m_FilterFreq;
+		if(!m_bStereoVoices)
+		{
+			NoteOutput = std::lerp(NoteOutput, ResoFilter(Note.m_Filter, 2.f * NoteOutput, Cutoff, m_Data->m_FilterReso, PassNr), FilterMix);
+			return { NoteOutput, NoteOutput };
+		}
+
+		// stereo voice : one ladder on mid, one on side
+		float Mid = .5f * (NoteOutput + NoteOutputR);
+		float Side = .5f * (NoteOutput - NoteOutputR);
+		Mid = std::lerp(Mid, ResoFilter(Note.m_Filter, 2.f * Mid, Cutoff, m_Data->m_FilterReso, PassNr), FilterMix);
+		Side = std::lerp(Side, ResoFilter(Note.m_SideFilter, 2.f * Side, Cutoff, m_Data->m_FilterReso, PassNr), FilterMix);
+		return { Mid + Side, Mid - Side };
+	}
+
 //-----------------------------------------------------
 	void AnalogSource::Render(long SampleNr)
 	{
 		static const float Dtime = 1.f / PlaybackFreq;
 
+		UpdateNoteCache();
+		UpdateUnisonLanes();
+
+		// keep decaying voice state out of the subnormal range, the scan still counts them when the policy is off
+		for(auto & Note : m_NoteTab)
+			m_Synth->m_Stats.m_SubnormalNr += Note.FlushDenormals(m_Synth->m_FlushDenormals);
+
+		// quality governor : cached voices are already cheap and must stay exact
+		for(auto & Note : m_NoteTab)
+		{
+			Note.m_Quality = Note.m_CacheEntry != nullptr ? VoiceQuality::Full : m_Synth->GetVoiceQuality(Note.m_Loudness);
+			if(Note.m_Quality != VoiceQuality::Drop)
+				continue;
+
+			if(!Note.m_NoteOn && Note.m_Loudness > 0.f)
+			{
+				Note.m_Died = true;
+				Note.m_AmpADSRValue = 0.f;
+				Note.m_Loudness = 0.f;
+				Note.ClearTails();
+				m_Synth->m_Stats.m_DroppedVoiceNr++;
+			}
+			Note.m_Quality = VoiceQuality::CheapWaveform;
+		}
+
 		int nbActiveNotes = 0;
 		for(auto & Note : m_NoteTab)
 			if(Note.m_NoteOn)
@@ -201,6 +705,19 @@ namespace SynthOX
 
 		long Cursor = m_Dest->m_WriteCursor;
 		const int PolyNoteNr = (m_Data->m_PolyphonyMode == PolyphonyMode::Poly ? AnalogsourcePolyphonyNoteNr : 1);
+
+		// portamento position Time seconds ahead, never overshooting the target note
+		auto Glide = [this](float Time) -> float
+		{
+			const float Target = float(m_NoteTab[0].m_Code);
+			const float NewBaseNote = m_PortamentoBaseNote + m_PortamentoStep * Time;
+			if(m_PortamentoBaseNote > Target)
+				return std::max(NewBaseNote, Target);
+			else if(m_PortamentoBaseNote < Target)
+				return std::min(NewBaseNote, Target);
+			return Target;
+		};
+
 		// compute samples
 		for(long i = 0; i < SampleNr; i++)
 		{
@@ -229,17 +746,41 @@ namespace SynthOX
 					FindNote(m_ArpeggioIdx + 1, AnalogsourcePolyphonyNoteNr);
 					if(m_ArpeggioIdx == OldIdx)
 						FindNote(0, m_ArpeggioIdx);
+
+					// arpeggio steps are jumps, not glides
+					if(m_ArpeggioIdx != OldIdx && m_Data->m_PolyphonyMode == PolyphonyMode::Arpeggio)
+						for(auto & Note : m_NoteTab)
+							Note.RestartPitch();
 				}
 			}
 
+			if(m_Data->m_PolyphonyMode == PolyphonyMode::Portamento)
+				m_PortamentoBaseNote = Glide(Dtime);
+
 			float Output = 0.f;
+			float OutputR = 0.f;
 			for(auto & Note : m_NoteTab)
 			{
-				float NoteOutput = 0.0f;
 				Note.m_Time += Dtime;
 	
 				// Get ADSR and Velocity
+				const bool bAlive = !Note.m_Died;
 				const float ADSRMultiplier = GetADSRValue(Note, Note.m_AmpADSRValue, m_Data->m_AmpADSR) * Note.m_Velocity;
+				Note.m_Loudness = ADSRMultiplier * std::max(m_Data->m_LeftVolume, m_Data->m_RightVolume);
+
+				// voice just died : drop its filter and smoothing tails instead of letting them decay into subnormals
+				if(bAlive && Note.m_Died && m_Synth->m_FlushDenormals)
+					Note.ClearTails();
+
+				// pre-rendered notes keep their clock running even when silent, to stay aligned with the cache
+				if(Note.m_CacheEntry != nullptr)
+				{
+					const float Val = RenderCachedVoice(Note) * ADSRMultiplier * .5f;
+					Output += Val;
+					OutputR += Val;
+					continue;
+				}
+
 				if(ADSRMultiplier == 0.0f)
 					continue;
 
@@ -253,15 +794,7 @@ namespace SynthOX
 					break;
 
 				case PolyphonyMode::Portamento:	
-					{
-						float NewBaseNote = m_PortamentoBaseNote + m_PortamentoStep * Dtime;
-						if(m_PortamentoBaseNote > m_NoteTab[0].m_Code)
-							m_PortamentoBaseNote = (NewBaseNote < m_NoteTab[0].m_Code ? m_NoteTab[0].m_Code : NewBaseNote);
-						else if(m_PortamentoBaseNote < m_NoteTab[0].m_Code)
-							m_PortamentoBaseNote = (NewBaseNote > m_NoteTab[0].m_Code ? m_NoteTab[0].m_Code : NewBaseNote);
-
-						BaseNote = m_PortamentoBaseNote;
-					}
+					BaseNote = Glide(float(PitchRampLength) * Dtime);
 					break;
 
 				default:
@@ -269,65 +802,22 @@ namespace SynthOX
 					break;
 				}
 
-				BaseNote += m_Synth->m_PitchBend * 2.f; // TODO : interpolate MIDI value based on TimeStamp
-
-				// update Oscillators
-				for(int j = 0; j < AnalogsourceOscillatorNr; j++)
-				{
-					auto & Oscillator = Note.m_OscillatorTab[j];
-					const auto & OscillatorData = m_Data->m_OscillatorTab[j];
-
-					auto LFOVal = [&Oscillator, Note](LFODest LFODest) -> float { return Oscillator.m_LFOTab[int(LFODest)].GetUpdatedValue(Note.m_Time); };
-					const float Volume		= std::max(LFOVal(LFODest::Volume ), 0.f);
-					const float Morph		= LFOVal(LFODest::Morph  );
-					const float Squish		= LFOVal(LFODest::Squish );
-					const float DistortGain	= LFOVal(LFODest::Distort);
-					const float StepShift	= LFOVal(LFODest::Tune   );
-					float Decat				= LFOVal(LFODest::Decat  );
-
-					float NoteFreq = GetNoteFreq(BaseNote + float(OscillatorData.m_NoteOffset));
-
-					for(int o = 0; o < OscillatorData.m_OctaveOffset; o++)	NoteFreq *= 2.0f;
-					for(int o = 0; o > OscillatorData.m_OctaveOffset; o--)	NoteFreq *= 0.5f;
-			
-					const float Alpha = .4f + .6f * std::clamp(Morph, 0.f, 1.f);
-					const float C = std::powf(Alpha, 10.f) * 30.f;
-					const float Flatness = Squish*Squish*Squish * 8.f;
-
-					Decat = std::ceilf(1.f + (1.f / (Decat*Decat*Decat + .001f)));
-					const float Cursor = Decat > 1000.f ? Oscillator.m_Cursor : (std::floor(Oscillator.m_Cursor * Decat) / Decat) + .5f / Decat;
-					auto GetVal = [Flatness, C](float c) -> float { return 1.f - Transfer(std::powf(c * 2.f, C), Flatness); };
-					float val = Cursor < .5f ? GetVal(Cursor) : -GetVal(1.f - Cursor);
-					val = Distortion(DistortGain, val) * Volume;
-
-					val = std::lerp(Oscillator.m_PrevVal, val, .4f);
-					Oscillator.m_PrevVal = val;
-
-					switch(OscillatorData.m_ModulationType)
-					{
-					case ModulationType::Mix:	NoteOutput += val;	break;
-					case ModulationType::Mul:	NoteOutput *= std::lerp(1.f, val, Oscillator.m_LFOTab[int(LFODest::Volume)].m_Data->m_BaseValue);	break;
-					case ModulationType::Ring:	NoteOutput *= 1.0f - 0.5f*(val+Volume);	break; // ???
-					}
-
-					// avance le curseur de lecture de l'oscillateur
-					Oscillator.m_Cursor += std::max(NoteFreq + StepShift, 0.f) / PlaybackFreq;		
-					Oscillator.m_Cursor -= std::floorf(Oscillator.m_Cursor);
-				}
-
-				const float FilterADSR = GetADSRValue(Note, Note.m_FilterADSRValue, m_Data->m_FilterADSR);
-				NoteOutput = std::lerp(NoteOutput, ResoFilter(Note, 2.f * NoteOutput, m_Data->m_FilterFreq*m_Data->m_FilterFreq, m_Data->m_FilterReso), m_Data->m_FilterDrive * (m_Data->m_InvFilterEnv ? FilterADSR : 1.f - FilterADSR));
+				BaseNote += m_Synth->m_PitchBend * 2.f; // interpolated by the pitch ramps
 
-				Output += NoteOutput * ADSRMultiplier * .5f;
+				const auto [Left, Right] = RenderVoice(Note, BaseNote);
+				Output += Left * ADSRMultiplier * .5f;
+				OutputR += Right * ADSRMultiplier * .5f;
 			}
 
 			Output = std::clamp(Output, -1.f, 1.f);
-			m_Dest->m_Data[Cursor] = { Output * m_Data->m_LeftVolume, Output * m_Data->m_RightVolume };
+			OutputR = std::clamp(OutputR, -1.f, 1.f);
+			m_Dest->m_Data[Cursor].first += Output * m_Data->m_LeftVolume;
+			m_Dest->m_Data[Cursor].second += OutputR * m_Data->m_RightVolume;
 			Cursor = (Cursor + 1) % PlaybackFreq;
 		}
 	}
 
-	float AnalogSource::ResoFilter(AnalogSourceNote & Note, float Input, float Cutoff, float Resonance) 
+	float AnalogSource::ResoFilter(LadderState & Ladder, float Input, float Cutoff, float Resonance, int PassNr) 
 	{
 		// filter based on the text "Non linear digital implementation of the moog ladder filter" by Antti Houvilainen
 		// adopted from Csound code at http://www.kunstmusik.com/udo/cache/moogladder.udo
@@ -339,7 +829,7 @@ namespace SynthOX
 		static const float sr = 22050.f;
 		const float cutoff_hz = Cutoff * sr;
 		const float kfc = cutoff_hz / sr; // sr is half the actual filter sampling rate
-		const float kf = .5f * kfc;
+		const float kf = kfc / float(PassNr); // PassNr times oversampled, a single pass keeps the same cutoff
 		
 		// frequency & amplitude correction
 		const float kfcr = 1.8730f*kfc*kfc*kfc + 0.4955f*kfc*kfc - 0.6490f*kfc + 0.9988f;
@@ -355,18 +845,18 @@ namespace SynthOX
 
 		auto Pass = [&]()
 		{
-			F(Note.ay1, Note.az1, Input - 4.f*Resonance*Note.amf*kacr);
-			F(Note.ay2, Note.az2, Note.ay1);
-			F(Note.ay3, Note.az3, Note.ay2);
-			F(Note.ay4, Note.az4, Note.ay3);
-			Note.amf  = (Note.ay4+Note.az5)*0.5f; // 1/2-sample delay for phase compensation
-			Note.az5  = Note.ay4;
+			F(Ladder.ay1, Ladder.az1, Input - 4.f*Resonance*Ladder.amf*kacr);
+			F(Ladder.ay2, Ladder.az2, Ladder.ay1);
+			F(Ladder.ay3, Ladder.az3, Ladder.ay2);
+			F(Ladder.ay4, Ladder.az4, Ladder.ay3);
+			Ladder.amf  = (Ladder.ay4+Ladder.az5)*0.5f; // 1/2-sample delay for phase compensation
+			Ladder.az5  = Ladder.ay4;
 		};
 
-		Pass();
-		Pass();
+		for(int i = 0; i < PassNr; i++)
+			Pass();
 
-		return Note.amf;
+		return Ladder.amf;
 	}
 };
 
@@ -0,0 +1,120 @@
+#include "SynthOX.h"
+#include <algorithm>
+
+namespace SynthOX
+{
+	// The render thread is the only one touching the Synth once started : it drains the event queue,
+	// splits each block at the event positions and publishes the block. Blocks live in a fixed ring,
+	// m_WrittenBlockNr / m_ReadBlockNr being the producer / consumer counters, m_WakeNr the wake up signal.
+
+	//-----------------------------------------------------
+	AsyncRenderer::AsyncRenderer(Synth & Synth, unsigned int BlockSize, int AheadBlockNr)
+		: m_Synth(Synth)
+		, m_BlockSize(BlockSize)
+		, m_AheadBlockNr(std::clamp(AheadBlockNr, 1, AsyncMaxAheadBlockNr))
+	{
+		assert(BlockSize > 0 && BlockSize <= PlaybackFreq);
+		m_BlockData.resize(size_t(m_BlockSize) * m_AheadBlockNr);
+	}
+
+	//-----------------------------------------------------
+	void AsyncRenderer::Start()
+	{
+		SYNTHOX_RT_FORBIDDEN();
+
+		if(m_Running)
+			return;
+
+		m_Running = true;
+		m_Thread = std::thread(&AsyncRenderer::ThreadFunc, this);
+	}
+
+	//-----------------------------------------------------
+	void AsyncRenderer::Stop()
+	{
+		if(!m_Running)
+			return;
+
+		// wake the render thread if it is waiting for room
+		m_Running = false;
+		m_WakeNr.fetch_add(1, std::memory_order_release);
+		m_WakeNr.notify_one();
+		m_Thread.join();
+	}
+
+	//-----------------------------------------------------
+	void AsyncRenderer::ThreadFunc()
+	{
+		while(m_Running)
+		{
+			const unsigned int WakeNr = m_WakeNr.load(std::memory_order_acquire);
+			const unsigned long long WrittenBlockNr = m_WrittenBlockNr.load(std::memory_order_relaxed);
+			const unsigned long long ReadBlockNr = m_ReadBlockNr.load(std::memory_order_acquire);
+			if(WrittenBlockNr - ReadBlockNr >= (unsigned long long)m_AheadBlockNr)
+			{
+				// ring is full, sleep until the consumer pops a block
+				m_WakeNr.wait(WakeNr);
+				continue;
+			}
+
+			RenderBlock(&m_BlockData[(WrittenBlockNr % m_AheadBlockNr) * m_BlockSize]);
+			m_WrittenBlockNr.store(WrittenBlockNr + 1, std::memory_order_release);
+		}
+	}
+
+	//-----------------------------------------------------
+	void AsyncRenderer::RenderBlock(std::pair<float, float> * Dest)
+	{
+		SYNTHOX_RT_SCOPE();
+
+		const unsigned long long BlockEnd = m_RenderedSampleNr + m_BlockSize;
+
+		unsigned int Done = 0;
+		while(Done < m_BlockSize)
+		{
+			const unsigned long long Pos = m_RenderedSampleNr + Done;
+
+			// apply everything due at this position, late events included
+			while(const SynthEvent * Event = m_EventQueue.Peek())
+			{
+				if(Event->m_SamplePos > Pos)
+					break;
+
+				m_Synth.ApplyEvent(*Event);
+				m_EventQueue.Pop();
+			}
+
+			// render up to the next event or the end of the block
+			unsigned int Len = m_BlockSize - Done;
+			if(const SynthEvent * Event = m_EventQueue.Peek(); Event != nullptr && Event->m_SamplePos < BlockEnd)
+				Len = (unsigned int)(Event->m_SamplePos - Pos);
+
+			m_Synth.Render(std::span(Dest + Done, Len));
+			Done += Len;
+		}
+
+		m_RenderedSampleNr = BlockEnd;
+	}
+
+	//-----------------------------------------------------
+	bool AsyncRenderer::PopBlock(std::span<std::pair<float, float>> Dest)
+	{
+		// called from the audio callback
+		SYNTHOX_RT_SCOPE();
+
+		assert(Dest.size() >= m_BlockSize);
+
+		const unsigned long long ReadBlockNr = m_ReadBlockNr.load(std::memory_order_relaxed);
+		if(ReadBlockNr == m_WrittenBlockNr.load(std::memory_order_acquire))
+			return false; // underrun
+
+		const auto * Src = &m_BlockData[(ReadBlockNr % m_AheadBlockNr) * m_BlockSize];
+		std::copy(Src, Src + m_BlockSize, Dest.begin());
+
+		m_ReadBlockNr.store(ReadBlockNr + 1, std::memory_order_release);
+		m_WakeNr.fetch_add(1, std::memory_order_release);
+		m_WakeNr.notify_one();
+		return true;
+	}
+
+};
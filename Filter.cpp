@@ -5,7 +5,7 @@ namespace SynthOX
 
 	void EchoFilterSource<>::Render(long _SampleNr)
 	{
-		long & wc = m_Dest->m_WriteCursor;
+		long wc = m_Dest->m_WriteCursor;
 
 		for(int i = 0; i < _SampleNr; i++)
 		{
@@ -44,6 +44,10 @@ namespace SynthOX
 			m_SrcWaveForm.m_WriteCursor = (m_SrcWaveForm.m_WriteCursor + 1) % m_SrcWaveForm.m_Data.size();
 			wc = (wc + 1) % m_Dest->m_Data.size();
 		}
+
+		// echo smoothing decays forever once the input is silent
+		if(m_Synth != nullptr)
+			m_Synth->m_Stats.m_SubnormalNr += FlushDenormal(m_S0, m_Synth->m_FlushDenormals) + FlushDenormal(m_S1, m_Synth->m_FlushDenormals);
 	}
 
 };
\ No newline at end of file
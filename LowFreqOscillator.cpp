@@ -5,10 +5,11 @@
 namespace SynthOX
 {
 	//-----------------------------------------------------
-	float LFOTransients::GetUpdatedValue(float NoteTime)
+	// single value, for the Tune LFO that is read once per pitch ramp
+	float LFOTransients::GetUpdatedValue(float NoteTime, int SampleNr)
 	{
-		float Dum;
-		m_Cursor = std::modf(m_Cursor + 1.f/PlaybackFreq, &Dum);
+		m_Cursor += float(SampleNr) / PlaybackFreq;
+		m_Cursor -= std::floor(m_Cursor);
 
 		if(NoteTime > m_Data->m_Delay)
 		{
@@ -30,6 +31,45 @@ namespace SynthOX
 		return 0.0f;
 	}
 
+	//-----------------------------------------------------
+	// Dest.size() successive values SampleNr samples apart, NoteTime being the time of the first one
+	void LFOTransients::GetUpdatedValues(float NoteTime, std::span<float> Dest, int SampleNr)
+	{
+		const float Inc = float(SampleNr) / PlaybackFreq;
+		const float Phase = m_Cursor + Inc;
+
+		m_Cursor += float(Dest.size()) * Inc;
+		m_Cursor -= std::floor(m_Cursor);
+
+		// delay ramp first, the waveform is only evaluated past it
+		size_t i = 0;
+		for(; i < Dest.size() && NoteTime <= m_Data->m_Delay; i++, NoteTime += Inc)
+		{
+			if(m_Data->m_Delay > 0.0f)
+			{
+				const float Ramp = m_Data->m_BaseValue * NoteTime / m_Data->m_Delay;
+				Dest[i] = m_ZeroCentered ? m_Data->m_BaseValue - Ramp : Ramp;
+			}
+			else
+			{
+				Dest[i] = 0.0f;
+			}
+		}
+
+		FillWaveform(m_Data->m_WF, Phase + float(i) * Inc, Inc, Dest.subspan(i));
+
+		for(; i < Dest.size(); i++, NoteTime += Inc)
+		{
+			float Val = Dest[i] * m_Data->m_Magnitude;
+
+			const float AttackTime = NoteTime - m_Data->m_Delay;
+			if(AttackTime < m_Data->m_Attack)
+				Val *= AttackTime / m_Data->m_Attack;
+
+			Dest[i] = (Val + 1.f) * m_Data->m_BaseValue;
+		}
+	}
+
 	//-----------------------------------------------------
 	void LFOTransients::NoteOn()
 	{
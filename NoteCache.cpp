@@ -0,0 +1,210 @@
+#include "SynthOX.h"
+#include <algorithm>
+
+namespace SynthOX
+{
+	// Pre-rendered notes : a deterministic patch always produces the same voice output for a given key,
+	// velocity and amp envelope being applied on top of it. The first trigger of a key records the voice output
+	// while held, later triggers just read it back. Voice state snapshots are kept every NoteCacheCheckpointPeriod
+	// samples so that live rendering can be resumed exactly on note off.
+
+	//-----------------------------------------------------
+	void AnalogSource::EnableNoteCache(bool Enable, size_t ByteBudget)
+	{
+		SYNTHOX_RT_FORBIDDEN();
+
+		ClearNoteCache();
+		m_NoteCacheEnabled = Enable;
+		m_NoteCacheData = *m_Data;
+		m_NoteCacheable = IsNoteCacheable();
+
+		// all slots are allocated here, recording never touches the heap
+		const size_t SlotSize = NoteCacheMaxLength * sizeof(float) + NoteCacheCheckpointNr * sizeof(NoteCacheEntry::Checkpoint);
+		const size_t SlotNr = Enable ? std::max<size_t>(ByteBudget / SlotSize, 1) : 0;
+
+		m_NoteCache.assign(SlotNr, {});
+		m_NoteCacheSamples.assign(SlotNr * NoteCacheMaxLength, 0.f);
+		m_NoteCacheCheckpoints.assign(SlotNr * NoteCacheCheckpointNr, {});
+		for(size_t i = 0; i < SlotNr; i++)
+		{
+			m_NoteCache[i].m_Samples = &m_NoteCacheSamples[i * NoteCacheMaxLength];
+			m_NoteCache[i].m_Checkpoints = &m_NoteCacheCheckpoints[i * NoteCacheCheckpointNr];
+		}
+	}
+
+	//-----------------------------------------------------
+	void AnalogSource::ClearNoteCache()
+	{
+		for(auto & Note : m_NoteTab)
+			DetachNoteCache(Note);
+
+		for(auto & Entry : m_NoteCache)
+			Entry.m_KeyId = -1;
+	}
+
+	//-----------------------------------------------------
+	bool AnalogSource::IsNoteCacheable() const
+	{
+		// arpeggio and portamento make a voice depend on the other notes
+		if(m_Data->m_PolyphonyMode != PolyphonyMode::Poly)
+			return false;
+
+		// entries are mono
+		for(const auto & Oscillator : m_Data->m_OscillatorTab)
+			if(Oscillator.m_UnisonNr > 1 && Oscillator.m_UnisonSpread > 0.f)
+				return false;
+
+		// free running or random LFOs make a voice depend on its trigger time
+		for(const auto & Oscillator : m_Data->m_OscillatorTab)
+			for(const auto & LFO : Oscillator.m_LFOTab)
+				if(LFO.m_Magnitude != 0.f && (!LFO.m_NoteSync || LFO.m_WF == WaveType::Rand))
+					return false;
+
+		return true;
+	}
+
+	//-----------------------------------------------------
+	void AnalogSource::UpdateNoteCache()
+	{
+		if(!m_NoteCacheEnabled)
+			return;
+
+		if(!(*m_Data == m_NoteCacheData))
+		{
+			ClearNoteCache();
+			m_NoteCacheData = *m_Data;
+			m_NoteCacheable = IsNoteCacheable();
+		}
+		else if(m_Synth->m_PitchBend != 0.f)
+		{
+			for(auto & Note : m_NoteTab)
+				DetachNoteCache(Note);
+		}
+	}
+
+	//-----------------------------------------------------
+	void AnalogSource::AttachNoteCache(AnalogSourceNote & Note)
+	{
+		if(!m_NoteCacheEnabled || !m_NoteCacheable || m_Synth == nullptr || m_Synth->m_PitchBend != 0.f)
+			return;
+
+		// a voice stolen during its release restarts its envelope from the current level,
+		// resetting its phases and filter there would click : it keeps rendering live
+		if(Note.m_AmpADSRValue != 0.f)
+			return;
+
+		// a filter envelope attack restarting from a released value would not match the recorded one
+		if(Note.m_FilterADSRValue != 0.f && m_Data->m_FilterADSR.m_Attack != 0.f && m_Data->m_FilterDrive != 0.f)
+			return;
+
+		DetachNoteCache(Note);
+
+		NoteCacheEntry * Entry = FindNoteCacheSlot(Note.m_Code);
+		if(Entry == nullptr)
+			return; // every slot is in use
+
+		const bool bRecord = (Entry->m_KeyId != Note.m_Code);
+		if(bRecord)
+		{
+			Entry->m_KeyId = Note.m_Code;
+			Entry->m_Length = 0;
+			Entry->m_Complete = false;
+		}
+		else if(!Entry->m_Complete)
+		{
+			return; // still being recorded by another voice
+		}
+
+		Note.Reset();
+		Note.m_CacheEntry = Entry;
+		Note.m_CacheIdx = 0;
+		Note.m_CacheRecording = bRecord;
+		Entry->m_LastUse = ++m_NoteCacheClock;
+	}
+
+	//-----------------------------------------------------
+	void AnalogSource::DetachNoteCache(AnalogSourceNote & Note, bool bResume)
+	{
+		static const float Dtime = 1.f / PlaybackFreq;
+
+		if(Note.m_CacheEntry == nullptr)
+			return;
+
+		auto & Entry = *Note.m_CacheEntry;
+		if(Note.m_CacheRecording)
+		{
+			// live state is already up to date, just seal the entry
+			Entry.m_Complete = true;
+		}
+		else if(bResume && Entry.m_Length > 0)
+		{
+			// restore the nearest snapshot and catch up to the playback position
+			const long CheckpointIdx = std::min(Note.m_CacheIdx, Entry.m_Length - 1) / NoteCacheCheckpointPeriod;
+			const auto & Checkpoint = Entry.m_Checkpoints[CheckpointIdx];
+			const float Time = Note.m_Time;
+
+			static_cast<VoiceState &>(Note) = Checkpoint.m_State;
+			Note.m_Time = Checkpoint.m_Time;
+			for(long i = CheckpointIdx * NoteCacheCheckpointPeriod; i < Note.m_CacheIdx; i++)
+			{
+				RenderVoice(Note, float(Note.m_Code));
+				Note.m_Time += Dtime;
+			}
+			Note.m_Time = Time;
+		}
+
+		Note.m_CacheEntry = nullptr;
+		Note.m_CacheRecording = false;
+		Note.m_CacheIdx = 0;
+	}
+
+	//-----------------------------------------------------
+	float AnalogSource::RenderCachedVoice(AnalogSourceNote & Note)
+	{
+		auto & Entry = *Note.m_CacheEntry;
+
+		if(Note.m_CacheRecording)
+		{
+			if(Note.m_CacheIdx % NoteCacheCheckpointPeriod == 0)
+				Entry.m_Checkpoints[Note.m_CacheIdx / NoteCacheCheckpointPeriod] = { Note, Note.m_Time };
+
+			const float Val = RenderVoice(Note, float(Note.m_Code)).first;
+			Entry.m_Samples[Entry.m_Length++] = Val;
+
+			if(++Note.m_CacheIdx >= NoteCacheMaxLength)
+				DetachNoteCache(Note);
+
+			return Val;
+		}
+
+		if(Note.m_CacheIdx < Entry.m_Length)
+			return Entry.m_Samples[Note.m_CacheIdx++];
+
+		// held longer than the recording
+		DetachNoteCache(Note);
+		return RenderVoice(Note, float(Note.m_Code)).first;
+	}
+
+	//-----------------------------------------------------
+	AnalogSource::NoteCacheEntry * AnalogSource::FindNoteCacheSlot(int KeyId)
+	{
+		auto IsInUse = [this](const NoteCacheEntry & Entry)
+		{
+			return std::any_of(std::begin(m_NoteTab), std::end(m_NoteTab), [&Entry](const AnalogSourceNote & Note) { return Note.m_CacheEntry == &Entry; });
+		};
+
+		// either the key's own slot, or the least recently used free one
+		NoteCacheEntry * Oldest = nullptr;
+		for(auto & Entry : m_NoteCache)
+		{
+			if(Entry.m_KeyId == KeyId)
+				return &Entry;
+
+			if(!IsInUse(Entry) && (Oldest == nullptr || Entry.m_LastUse < Oldest->m_LastUse))
+				Oldest = &Entry;
+		}
+
+		return Oldest;
+	}
+
+};
@@ -0,0 +1,379 @@
+#include "SynthOX.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <cstdio>
+#include <type_traits>
+#include <functional>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace SynthOX
+{
+	// Chunk files are named after their 64 bits key : a header, OfflineChunkLength interleaved float frames (none for a
+	// silent chunk), then the stem render state at the chunk end. Keys chain the hash of the stem inputs with the events
+	// up to the chunk end, a change at some point of the song thus invalidates the chunks from there on only, and their
+	// render resumes from the state stored with the last clean chunk.
+
+	namespace
+	{
+		struct ChunkHeader
+		{
+			char			m_Magic[4] = { 'S', 'X', 'C', '2' };
+			unsigned int	m_Version = SynthEngineVersion;
+			unsigned int	m_FrameNr = 0;		// OfflineChunkLength, 0 for silence
+			unsigned int	m_StateSize = 0;	// size of the render state following the frames, layouts differ between builds
+		};
+
+		//_________________________________________________
+		// FNV-1a, fed field by field so that struct padding never reaches the key
+		class Hasher
+		{
+			unsigned long long	m_Hash = 14695981039346656037ull;
+
+		public:
+			template <class T> requires std::is_arithmetic_v<T> || std::is_enum_v<T>
+			void Add(const T & Val)
+			{
+				const auto * Bytes = reinterpret_cast<const unsigned char *>(&Val);
+				for(size_t i = 0; i < sizeof(T); i++)
+				{
+					m_Hash ^= Bytes[i];
+					m_Hash *= 1099511628211ull;
+				}
+			}
+
+			void Add(const LFOData & Data)
+			{
+				Add(Data.m_Delay); Add(Data.m_Attack); Add(Data.m_Magnitude); Add(Data.m_Rate); Add(Data.m_BaseValue); Add(Data.m_WF); Add(Data.m_NoteSync);
+			}
+
+			void Add(const OscillatorData & Data)
+			{
+				for(const auto & LFO : Data.m_LFOTab)
+					Add(LFO);
+
+				Add(Data.m_OctaveOffset); Add(Data.m_NoteOffset); Add(Data.m_ModulationType);
+				Add(Data.m_UnisonNr); Add(Data.m_UnisonDetune); Add(Data.m_UnisonSpread);
+			}
+
+			void Add(const ADSRData & Data)
+			{
+				Add(Data.m_Attack); Add(Data.m_Decay); Add(Data.m_Sustain); Add(Data.m_Release);
+			}
+
+			void Add(const AnalogSourceData & Data)
+			{
+				for(const auto & Oscillator : Data.m_OscillatorTab)
+					Add(Oscillator);
+
+				Add(Data.m_AmpADSR); Add(Data.m_FilterADSR); Add(Data.m_InvFilterEnv);
+				Add(Data.m_FilterDrive); Add(Data.m_FilterFreq); Add(Data.m_FilterReso);
+				Add(Data.m_LeftVolume); Add(Data.m_RightVolume);
+				Add(Data.m_PortamentoTime); Add(Data.m_ArpeggioPeriod); Add(Data.m_PolyphonyMode);
+			}
+
+			void Add(const KeyZone & Zone)
+			{
+				Add(Zone.m_KeyLow); Add(Zone.m_KeyHigh); Add(Zone.m_VelocityLow); Add(Zone.m_VelocityHigh);
+			}
+
+			void Add(const SynthEvent & Event)
+			{
+				Add(Event.m_SamplePos); Add(Event.m_Type); Add(Event.m_Channel); Add(Event.m_KeyId); Add(Event.m_Value);
+			}
+
+			unsigned long long Get() const { return m_Hash; }
+		};
+
+		//-----------------------------------------------------
+		int GetProcessId()
+		{
+#ifdef _WIN32
+			return _getpid();
+#else
+			return int(getpid());
+#endif
+		}
+
+		//-----------------------------------------------------
+		bool IsStemCacheable(const AnalogSourceData & Data)
+		{
+			// random LFOs share a global generator, their output depends on every other source
+			for(const auto & Oscillator : Data.m_OscillatorTab)
+				for(const auto & LFO : Oscillator.m_LFOTab)
+					if(LFO.m_Magnitude != 0.f && LFO.m_WF == WaveType::Rand)
+						return false;
+
+			return true;
+		}
+	};
+
+	//-----------------------------------------------------
+	OfflineRenderer::OfflineRenderer(const std::string & CacheDir) : m_CacheDir(CacheDir)
+	{
+	}
+
+	//-----------------------------------------------------
+	void OfflineRenderer::AddSource(AnalogSourceData & Data, int Channel, const KeyZone & Zone)
+	{
+		m_StemTab.push_back({ &Data, Channel, Zone });
+	}
+
+	//-----------------------------------------------------
+	void OfflineRenderer::SetEvents(std::span<const SynthEvent> Events)
+	{
+		m_EventTab.assign(Events.begin(), Events.end());
+		std::stable_sort(m_EventTab.begin(), m_EventTab.end(), [](const SynthEvent & A, const SynthEvent & B) { return A.m_SamplePos < B.m_SamplePos; });
+	}
+
+	//-----------------------------------------------------
+	void OfflineRenderer::Render(unsigned long long Start, unsigned long long End, std::vector<std::pair<float, float>> & Out)
+	{
+		assert(Start <= End);
+
+		Out.assign(size_t(End - Start), { 0.f, 0.f });
+		for(const auto & Stem : m_StemTab)
+			RenderStem(Stem, Start, End, Out);
+
+		for(auto & [Left, Right] : Out)
+		{
+			Left = std::clamp(Left, -1.f, 1.f);
+			Right = std::clamp(Right, -1.f, 1.f);
+		}
+	}
+
+	//-----------------------------------------------------
+	void OfflineRenderer::RenderStem(const Stem & Stem, unsigned long long Start, unsigned long long End, std::vector<std::pair<float, float>> & Mix)
+	{
+		if(Start == End)
+			return;
+
+		std::vector<SynthEvent> EventTab;
+		for(const auto & Event : m_EventTab)
+			if(Event.m_Type == SynthEventType::PitchBend || Event.m_Channel == Stem.m_Channel)
+				EventTab.push_back(Event);
+
+		Hasher StemHash;
+		StemHash.Add(SynthEngineVersion);
+		StemHash.Add(PlaybackFreq);
+		StemHash.Add(*Stem.m_Data);
+		StemHash.Add(Stem.m_Channel);
+		StemHash.Add(Stem.m_Zone);
+
+		const long FirstChunk = long(Start / OfflineChunkLength);
+		const long EndChunk = long((End + OfflineChunkLength - 1) / OfflineChunkLength);
+
+		std::vector<unsigned long long> KeyTab(EndChunk);
+		size_t EventIdx = 0;
+		for(long k = 0; k < EndChunk; k++)
+		{
+			const unsigned long long ChunkEnd = (unsigned long long)(k + 1) * OfflineChunkLength;
+			for(; EventIdx < EventTab.size() && EventTab[EventIdx].m_SamplePos < ChunkEnd; EventIdx++)
+				StemHash.Add(EventTab[EventIdx]);
+
+			Hasher ChunkHash = StemHash;
+			ChunkHash.Add(k);
+			KeyTab[k] = ChunkHash.Get();
+		}
+
+		auto MixChunk = [&](long k, const std::pair<float, float> * Chunk)
+		{
+			const unsigned long long ChunkStart = (unsigned long long)k * OfflineChunkLength;
+			const unsigned long long From = std::max(Start, ChunkStart);
+			const unsigned long long To = std::min(End, ChunkStart + OfflineChunkLength);
+			for(unsigned long long Pos = From; Pos < To; Pos++)
+			{
+				Mix[Pos - Start].first += Chunk[Pos - ChunkStart].first;
+				Mix[Pos - Start].second += Chunk[Pos - ChunkStart].second;
+			}
+		};
+
+		const bool bCacheable = IsStemCacheable(*Stem.m_Data);
+		std::vector<std::pair<float, float>> Chunk(OfflineChunkLength);
+
+		// live render, (re)started on the dirty chunks that do not follow it
+		std::unique_ptr<Synth> StemSynth;
+		std::unique_ptr<AnalogSource> Source;
+		long LiveChunk = -1;
+
+		auto RenderChunk = [&](long k)
+		{
+			auto & OutBuf = StemSynth->m_OutBuf;
+			unsigned long long Pos = (unsigned long long)k * OfflineChunkLength;
+			for(long i = 0; i < OfflineChunkLength; )
+			{
+				for(; EventIdx < EventTab.size() && EventTab[EventIdx].m_SamplePos <= Pos; EventIdx++)
+					StemSynth->ApplyEvent(EventTab[EventIdx]);
+
+				// fixed block grid, split at the event positions
+				long Len = OfflineBlockLength - i % OfflineBlockLength;
+				if(EventIdx < EventTab.size())
+					Len = long(std::min<unsigned long long>(Len, EventTab[EventIdx].m_SamplePos - Pos));
+
+				// stems are mixed unclamped, the clamp applies to the final mix
+				StemSynth->Render(Len);
+				for(long j = 0; j < Len; j++)
+				{
+					Chunk[i + j] = OutBuf.m_Data[OutBuf.m_WriteCursor];
+					OutBuf.m_WriteCursor = (OutBuf.m_WriteCursor + 1) % OutBuf.m_Data.size();
+				}
+
+				i += Len;
+				Pos += Len;
+			}
+
+			if(bCacheable)
+			{
+				StemState State;
+				State.m_PitchBend = StemSynth->m_PitchBend;
+				Source->SaveRenderState(State.m_Source);
+				StoreChunk(KeyTab[k], Chunk, State);
+			}
+
+			LiveChunk = k + 1;
+		};
+
+		for(long k = FirstChunk; k < EndChunk; k++)
+		{
+			// clean chunks are read back and mixed one at a time
+			if(bCacheable && LoadChunk(KeyTab[k], Chunk))
+			{
+				MixChunk(k, Chunk.data());
+				m_Stats.m_ReusedChunkNr++;
+				continue;
+			}
+
+			if(LiveChunk != k)
+			{
+				// resume from the state stored with the last clean chunk before this one, or from the song start
+				auto State = std::make_unique<StemState>();
+				long From = k;
+				while(From > 0 && !(bCacheable && LoadChunkState(KeyTab[From - 1], *State)))
+					From--;
+
+				if(StemSynth == nullptr)
+					m_Stats.m_RenderedStemNr++;
+
+				StemSynth = std::make_unique<Synth>();
+				Source = std::make_unique<AnalogSource>(&StemSynth->m_OutBuf, Stem.m_Channel, Stem.m_Data);
+				StemSynth->BindSource(*Source, Stem.m_Zone);
+				if(From > 0)
+				{
+					StemSynth->m_PitchBend = State->m_PitchBend;
+					Source->LoadRenderState(State->m_Source);
+				}
+
+				const unsigned long long FromPos = (unsigned long long)From * OfflineChunkLength;
+				EventIdx = size_t(std::partition_point(EventTab.begin(), EventTab.end(), [FromPos](const SynthEvent & Event) { return Event.m_SamplePos < FromPos; }) - EventTab.begin());
+
+				for(long i = From; i < k; i++)
+				{
+					RenderChunk(i);
+					m_Stats.m_PrerollChunkNr++;
+				}
+			}
+
+			RenderChunk(k);
+			MixChunk(k, Chunk.data());
+			m_Stats.m_RenderedChunkNr++;
+		}
+	}
+
+	//-----------------------------------------------------
+	std::string OfflineRenderer::GetChunkPath(unsigned long long Key) const
+	{
+		char Name[32];
+		std::snprintf(Name, sizeof(Name), "%016llx.sxc", Key);
+		return (std::filesystem::path(m_CacheDir) / Name).string();
+	}
+
+	//-----------------------------------------------------
+	bool OfflineRenderer::LoadChunk(unsigned long long Key, std::vector<std::pair<float, float>> & Chunk) const
+	{
+		std::ifstream File(GetChunkPath(Key), std::ios::binary);
+		if(!File)
+			return false;
+
+		const ChunkHeader Expected;
+		ChunkHeader Header;
+		File.read(reinterpret_cast<char *>(&Header), sizeof(Header));
+		if(!File || !std::equal(std::begin(Header.m_Magic), std::end(Header.m_Magic), std::begin(Expected.m_Magic)) || Header.m_Version != SynthEngineVersion)
+			return false;
+
+		if(Header.m_FrameNr == 0)
+		{
+			std::fill(Chunk.begin(), Chunk.end(), std::pair<float, float>(0.f, 0.f));
+			return true;
+		}
+
+		if(Header.m_FrameNr != OfflineChunkLength)
+			return false;
+
+		File.read(reinterpret_cast<char *>(Chunk.data()), OfflineChunkLength * sizeof(Chunk[0]));
+		return bool(File);
+	}
+
+	//-----------------------------------------------------
+	bool OfflineRenderer::LoadChunkState(unsigned long long Key, StemState & State) const
+	{
+		std::ifstream File(GetChunkPath(Key), std::ios::binary);
+		if(!File)
+			return false;
+
+		const ChunkHeader Expected;
+		ChunkHeader Header;
+		File.read(reinterpret_cast<char *>(&Header), sizeof(Header));
+		if(!File || !std::equal(std::begin(Header.m_Magic), std::end(Header.m_Magic), std::begin(Expected.m_Magic)) || Header.m_Version != SynthEngineVersion)
+			return false;
+
+		if(Header.m_StateSize != sizeof(StemState) || (Header.m_FrameNr != 0 && Header.m_FrameNr != OfflineChunkLength))
+			return false;
+
+		File.seekg(std::streamoff(Header.m_FrameNr * sizeof(std::pair<float, float>)), std::ios::cur);
+		File.read(reinterpret_cast<char *>(&State), sizeof(State));
+		return bool(File);
+	}
+
+	//-----------------------------------------------------
+	void OfflineRenderer::StoreChunk(unsigned long long Key, const std::vector<std::pair<float, float>> & Chunk, const StemState & State) const
+	{
+		// chunks are only rendered when their file is missing or unreadable, an existing one is replaced
+		const std::string Path = GetChunkPath(Key);
+
+		std::error_code Error;
+		std::filesystem::create_directories(m_CacheDir, Error);
+
+		ChunkHeader Header;
+		const bool bSilent = std::all_of(Chunk.begin(), Chunk.end(), [](const std::pair<float, float> & Val) { return Val.first == 0.f && Val.second == 0.f; });
+		Header.m_FrameNr = bSilent ? 0 : OfflineChunkLength;
+		Header.m_StateSize = sizeof(StemState);
+
+		// written aside under a name unique to this process and thread then renamed,
+		// concurrent bounces never see a partial chunk nor write into each other's temp file
+		char Suffix[48];
+		std::snprintf(Suffix, sizeof(Suffix), ".%d.%zx.tmp", GetProcessId(), std::hash<std::thread::id>()(std::this_thread::get_id()));
+		const std::string TempPath = Path + Suffix;
+		{
+			std::ofstream File(TempPath, std::ios::binary);
+			File.write(reinterpret_cast<const char *>(&Header), sizeof(Header));
+			if(!bSilent)
+				File.write(reinterpret_cast<const char *>(Chunk.data()), OfflineChunkLength * sizeof(Chunk[0]));
+
+			File.write(reinterpret_cast<const char *>(&State), sizeof(State));
+
+			if(!File)
+			{
+				File.close();
+				std::filesystem::remove(TempPath, Error);
+				return;
+			}
+		}
+
+		std::filesystem::rename(TempPath, Path, Error);
+	}
+
+};
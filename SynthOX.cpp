@@ -3,97 +3,409 @@
 #include <algorithm>
 #include <assert.h>
 #include <cmath>
+#include <cstdlib>
+#include <new>
+#include <limits>
+#include <chrono>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <xmmintrin.h>
+#define SYNTHOX_HAS_MXCSR
+#endif
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SYNTHOX_HAS_SSE2
+#endif
 
 namespace SynthOX
 {
+	namespace RTAudit
+	{
+		thread_local int gRenderDepth = 0;
+	};
 
 	//-----------------------------------------------------------------------------
 	int gRand_x1 = 0x67452301;
 	int gRand_x2 = 0xefcdab89;
-	float GetWaveformValue(WaveType Type, float Cursor)
+
+	namespace
 	{
-		switch(Type)
+		template <WaveType Type>
+		inline float WaveformSample(float Cursor)
 		{
-		case WaveType::Square:		return Cursor >= .5f ? -1.f : 1.f;
-		case WaveType::Saw:			return 1.f - 2.f * Cursor;
-		case WaveType::Triangle:	return Cursor < .5f ? 1.f - 4.f * Cursor : -1.f + 4.f * (Cursor - .5f);
-		case WaveType::Sine:		return sinf(Cursor * 3.14159f*2.f);
-		case WaveType::Rand:
+			if constexpr(Type == WaveType::Square)		return Cursor >= .5f ? -1.f : 1.f;
+			if constexpr(Type == WaveType::Saw)			return 1.f - 2.f * Cursor;
+			if constexpr(Type == WaveType::Triangle)
+			{
+				// both slopes computed ahead so that the select needs no branch
+				const float Up = 1.f - 4.f * Cursor;
+				const float Down = -1.f + 4.f * (Cursor - .5f);
+				return Cursor < .5f ? Up : Down;
+			}
+			if constexpr(Type == WaveType::Sine)		return sinf(Cursor * 3.14159f*2.f);
+			if constexpr(Type == WaveType::Rand)
 			{
 				gRand_x1 ^= gRand_x2;
 				float Ret = float(gRand_x2);
 				gRand_x2 += gRand_x1;
 				return Ret;
 			}
+			return 0.f;
 		}
 
-		return 0.f;
-	}
+		// polynomial residual of a unit step at phase 0, spread over one sample on each side (selects only, no branch)
+		inline float PolyBLEP(float Cursor, float Inc)
+		{
+			const float t0 = Cursor / Inc;
+			const float t1 = (Cursor - 1.f) / Inc;
+			const float After = t0 + t0 - t0 * t0 - 1.f;
+			const float Before = t1 * t1 + t1 + t1 + 1.f;
+			return Cursor < Inc ? After : (Cursor > 1.f - Inc ? Before : 0.f);
+		}
 
-	//-----------------------------------------------------------------------------
-	void FloatClear(float * Dest, long len) { std::memset(Dest, 0, len*sizeof(float)); }
+		// fractional part, truncation and a compare instead of std::floor which SSE2 lacks
+		inline float WrapPhase(float Cursor)
+		{
+			Cursor -= float(int(Cursor));
+			return Cursor < 0.f ? Cursor + 1.f : Cursor;
+		}
 
-	//-----------------------------------------------------
-	float GetNoteFreq(float NoteCode) { return 440.f * std::powf(1.059463f, NoteCode-69.f); }
+#ifdef SYNTHOX_HAS_SSE2
+		inline __m128 Select(__m128 Mask, __m128 A, __m128 B) { return _mm_or_ps(_mm_and_ps(Mask, A), _mm_andnot_ps(Mask, B)); }
 
-	//-----------------------------------------------------
-	float Distortion(float _Gain, float _Sample)
-	{
-	//	float absx = (_Sample<0.0f) ? -_Sample: _Sample;
-	//	_Sample = _Sample*(absx + _Gain)/(_Sample*_Sample + (_Gain-1.0f)*absx + 1.0f);
+		inline __m128 WrapPhase(__m128 Cursor)
+		{
+			Cursor = _mm_sub_ps(Cursor, _mm_cvtepi32_ps(_mm_cvttps_epi32(Cursor)));
+			return _mm_add_ps(Cursor, _mm_and_ps(_mm_cmplt_ps(Cursor, _mm_setzero_ps()), _mm_set1_ps(1.f)));
+		}
+
+		//-----------------------------------------------------
+		// sin(2 pi x) for x in [0..1[ : folded on the quarter period, then the odd Taylor polynomial up to x^11
+		inline __m128 SinCyclePS(__m128 x)
+		{
+			const __m128 Half = _mm_set1_ps(.5f);
+			x = _mm_sub_ps(x, _mm_and_ps(_mm_cmpge_ps(x, Half), _mm_set1_ps(1.f)));
+			x = Select(_mm_cmpgt_ps(x, _mm_set1_ps(.25f)), _mm_sub_ps(Half, x), x);
+			x = Select(_mm_cmplt_ps(x, _mm_set1_ps(-.25f)), _mm_sub_ps(_mm_set1_ps(-.5f), x), x);
 
-		_Sample *= 1.0f + _Gain;
-		_Sample = 1.5f*_Sample - 0.5f*_Sample*_Sample*_Sample;
+			const __m128 a = _mm_mul_ps(x, _mm_set1_ps(6.28318531f));
+			const __m128 z = _mm_mul_ps(a, a);
+			__m128 y = _mm_set1_ps(-2.50521084e-8f);
+			for(const float Coef : { 2.75573192e-6f, -1.98412698e-4f, 8.33333333e-3f, -1.66666667e-1f })
+				y = _mm_add_ps(_mm_mul_ps(y, z), _mm_set1_ps(Coef));
+
+			return _mm_add_ps(a, _mm_mul_ps(_mm_mul_ps(y, z), a));
+		}
+
+		template <WaveType Type>
+		inline __m128 WaveformSample(__m128 Cursor)
+		{
+			const __m128 One = _mm_set1_ps(1.f);
+			if constexpr(Type == WaveType::Square)		return Select(_mm_cmpge_ps(Cursor, _mm_set1_ps(.5f)), _mm_set1_ps(-1.f), One);
+			if constexpr(Type == WaveType::Saw)			return _mm_sub_ps(One, _mm_mul_ps(_mm_set1_ps(2.f), Cursor));
+			if constexpr(Type == WaveType::Triangle)
+			{
+				const __m128 Four = _mm_set1_ps(4.f);
+				const __m128 Up = _mm_sub_ps(One, _mm_mul_ps(Four, Cursor));
+				const __m128 Down = _mm_add_ps(_mm_set1_ps(-1.f), _mm_mul_ps(Four, _mm_sub_ps(Cursor, _mm_set1_ps(.5f))));
+				return Select(_mm_cmplt_ps(Cursor, _mm_set1_ps(.5f)), Up, Down);
+			}
+			if constexpr(Type == WaveType::Sine)		return SinCyclePS(Cursor);
+			return _mm_setzero_ps();
+		}
 
-		/*
-		while(_Sample > 1.0f || _Sample < -1.0f)
+		inline __m128 PolyBLEP(__m128 Cursor, __m128 Inc)
 		{
-			if(_Sample > 0.0f)
-				_Sample = 2.0f - _Sample;
-			else
-				_Sample = -2.0f - _Sample;
+			const __m128 One = _mm_set1_ps(1.f);
+			const __m128 t0 = _mm_div_ps(Cursor, Inc);
+			const __m128 t1 = _mm_div_ps(_mm_sub_ps(Cursor, One), Inc);
+			const __m128 After = _mm_sub_ps(_mm_sub_ps(_mm_add_ps(t0, t0), _mm_mul_ps(t0, t0)), One);
+			const __m128 Before = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(t1, t1), t1), t1), One);
+			return Select(_mm_cmplt_ps(Cursor, Inc), After, _mm_and_ps(_mm_cmpgt_ps(Cursor, _mm_sub_ps(One, Inc)), Before));
 		}
-		*/
+#endif
 
-	/*
-	#define DIST_LIMIT (0.65f)
-		if(_Sample > 1.0f)
+		template <WaveType Type, bool bBandLimited>
+		void FillWaveformT(float Phase, float PhaseInc, std::span<float> Dest)
 		{
-			while(_Sample > 1.0f || _Sample < DIST_LIMIT)
+			const int SampleNr = int(Dest.size());
+			float * Out = Dest.data();
+
+			// the random generator is a sequence, everything else only depends on the sample index
+			if constexpr(Type == WaveType::Rand)
 			{
-				if(_Sample > 1.0f)
-					_Sample = 2.0f - _Sample;
-				if(_Sample < DIST_LIMIT)
-					_Sample = DIST_LIMIT + DIST_LIMIT - _Sample;
+				for(int i = 0; i < SampleNr; i++)
+					Out[i] = WaveformSample<Type>(0.f);
+				return;
+			}
+
+			int i = 0;
+#ifdef SYNTHOX_HAS_SSE2
+			// 4 samples at a time, the scalar loop below finishes the block
+			const __m128 Inc = _mm_set1_ps(PhaseInc);
+			for(; i + 4 <= SampleNr; i += 4)
+			{
+				const __m128 Idx = _mm_add_ps(_mm_set1_ps(float(i)), _mm_setr_ps(0.f, 1.f, 2.f, 3.f));
+				const __m128 Cursor = WrapPhase(_mm_add_ps(_mm_set1_ps(Phase), _mm_mul_ps(Idx, Inc)));
+
+				__m128 Val = WaveformSample<Type>(Cursor);
+				if constexpr(bBandLimited && Type == WaveType::Saw)
+				{
+					Val = _mm_add_ps(Val, PolyBLEP(Cursor, Inc));
+				}
+				else if constexpr(bBandLimited && Type == WaveType::Square)
+				{
+					const __m128 HalfCursor = WrapPhase(_mm_add_ps(Cursor, _mm_set1_ps(.5f)));
+					Val = _mm_add_ps(Val, _mm_sub_ps(PolyBLEP(Cursor, Inc), PolyBLEP(HalfCursor, Inc)));
+				}
+				_mm_storeu_ps(Out + i, Val);
+			}
+#endif
+
+			for(; i < SampleNr; i++)
+			{
+				const float Cursor = WrapPhase(Phase + float(i) * PhaseInc);
+
+				float Val = WaveformSample<Type>(Cursor);
+				if constexpr(bBandLimited && Type == WaveType::Saw)
+				{
+					Val += PolyBLEP(Cursor, PhaseInc);
+				}
+				else if constexpr(bBandLimited && Type == WaveType::Square)
+				{
+					const float HalfCursor = WrapPhase(Cursor + .5f);
+					Val += PolyBLEP(Cursor, PhaseInc) - PolyBLEP(HalfCursor, PhaseInc);
+				}
+				Out[i] = Val;
 			}
 		}
-		else if(_Sample < -1.0f)
+
+		template <bool bBandLimited>
+		void FillWaveformT(WaveType Type, float Phase, float PhaseInc, std::span<float> Dest)
 		{
-			while(_Sample < -1.0f || _Sample > -DIST_LIMIT)
+			switch(Type)
 			{
-				if(_Sample < -1.0f)
-					_Sample = -2.0f - _Sample;
-				if(_Sample > -DIST_LIMIT)
-					_Sample = -DIST_LIMIT - DIST_LIMIT - _Sample;
+			case WaveType::Square:		FillWaveformT<WaveType::Square, bBandLimited>(Phase, PhaseInc, Dest); break;
+			case WaveType::Saw:			FillWaveformT<WaveType::Saw, bBandLimited>(Phase, PhaseInc, Dest); break;
+			case WaveType::Triangle:	FillWaveformT<WaveType::Triangle, bBandLimited>(Phase, PhaseInc, Dest); break;
+			case WaveType::Sine:		FillWaveformT<WaveType::Sine, bBandLimited>(Phase, PhaseInc, Dest); break;
+			case WaveType::Rand:		FillWaveformT<WaveType::Rand, bBandLimited>(Phase, PhaseInc, Dest); break;
+			default:					std::fill(Dest.begin(), Dest.end(), 0.f); break;
 			}
 		}
-	*/
-		return _Sample;
+	};
+
+	//-----------------------------------------------------------------------------
+	float GetWaveformValue(WaveType Type, float Cursor)
+	{
+		switch(Type)
+		{
+		case WaveType::Square:		return WaveformSample<WaveType::Square>(Cursor);
+		case WaveType::Saw:			return WaveformSample<WaveType::Saw>(Cursor);
+		case WaveType::Triangle:	return WaveformSample<WaveType::Triangle>(Cursor);
+		case WaveType::Sine:		return WaveformSample<WaveType::Sine>(Cursor);
+		case WaveType::Rand:		return WaveformSample<WaveType::Rand>(Cursor);
+		default:					break;
+		}
+
+		return 0.f;
+	}
+
+	//-----------------------------------------------------------------------------
+	// Batched waveform : the type is dispatched once, the per type loops carry no dependency between samples
+	// (Rand aside) and run 4 wide on SSE2. bBandLimited applies polyBLEP to the Saw and Square steps, PhaseInc
+	// being their frequency in cycles per sample. Returns the phase following the block.
+	float FillWaveform(WaveType Type, float Phase, float PhaseInc, std::span<float> Dest, bool bBandLimited)
+	{
+		if(bBandLimited)
+			FillWaveformT<true>(Type, Phase, PhaseInc, Dest);
+		else
+			FillWaveformT<false>(Type, Phase, PhaseInc, Dest);
+
+		const float NextPhase = Phase + float(Dest.size()) * PhaseInc;
+		return NextPhase - std::floor(NextPhase);
+	}
+
+	//-----------------------------------------------------------------------------
+	void FloatClear(float * Dest, long len) { std::memset(Dest, 0, len*sizeof(float)); }
+
+	//-----------------------------------------------------
+	// returns whether Val was subnormal, near zero values are only flushed when bFlush
+	bool FlushDenormal(float & Val, bool bFlush)
+	{
+		if(Val == 0.f || std::fabs(Val) >= DenormalThreshold)
+			return false;
+
+		const bool bSubnormal = std::fabs(Val) < std::numeric_limits<float>::min();
+		if(bFlush)
+			Val = 0.f;
+		return bSubnormal;
+	}
+
+	//-----------------------------------------------------
+	DenormalGuard::DenormalGuard(bool Enable)
+	{
+#ifdef SYNTHOX_HAS_MXCSR
+		if(Enable)
+		{
+			m_SavedCSR = _mm_getcsr();
+			_mm_setcsr(m_SavedCSR | 0x8040); // FTZ | DAZ
+			m_Active = true;
+		}
+#endif
+	}
+
+	DenormalGuard::~DenormalGuard()
+	{
+#ifdef SYNTHOX_HAS_MXCSR
+		if(m_Active)
+			_mm_setcsr(m_SavedCSR);
+#endif
+	}
+
+	//-----------------------------------------------------
+	static const int OctaveTabRes = 256;
+	static const auto gOctaveTab = []()
+	{
+		std::array<float, OctaveTabRes + 1> Tab;
+		for(int i = 0; i <= OctaveTabRes; i++)
+			Tab[i] = std::exp2(float(i) / OctaveTabRes);
+		return Tab;
+	}();
+
+	float GetNoteFreq(float NoteCode)
+	{
+		// 2^x split into an exact power of two and an interpolated fraction of octave
+		const float Octaves = (NoteCode - 69.f) / 12.f;
+		const float Floor = std::floor(Octaves);
+		const float Pos = (Octaves - Floor) * OctaveTabRes;
+		const int Idx = std::min(int(Pos), OctaveTabRes - 1);
+		return std::ldexp(440.f * std::lerp(gOctaveTab[Idx], gOctaveTab[Idx + 1], Pos - float(Idx)), int(Floor));
 	}
 
 	//-----------------------------------------------------
 	void Synth::Render(unsigned int SamplesToRender)
 	{
+		SYNTHOX_RT_SCOPE();
+		DenormalGuard Guard(m_FlushDenormals);
+		const auto StartTime = std::chrono::steady_clock::now();
+
 		assert(SamplesToRender <= m_OutBuf.m_Data.size());
 		assert(m_SourceTab.size() > 0);
 
-		// clear out buffers
-		for(auto & Source : m_SourceTab)
-			Source->GetDest().Clear(SamplesToRender);
+		// clear out buffers, once each as layered sources mix into the same one
+		for(auto & Dest : m_DestTab)
+			Dest->Clear(SamplesToRender);
 
 		// render source buffers en reverse
 		for(int i = int(m_SourceTab.size()) - 1; i >= 0; i--)
 			m_SourceTab[i]->Render(SamplesToRender);
+
+		if(m_Governor.m_Enabled)
+			UpdateGovernor(std::chrono::duration<float>(std::chrono::steady_clock::now() - StartTime).count(), SamplesToRender);
+	}
+
+	//-----------------------------------------------------
+	void Synth::UpdateGovernor(float RenderTime, unsigned int SamplesRendered)
+	{
+		if(SamplesRendered == 0)
+			return;
+
+		const float Load = RenderTime * PlaybackFreq / float(SamplesRendered);
+		m_Stats.m_Load = std::lerp(m_Stats.m_Load, Load, .25f);
+
+		// degrade fast, recover slowly
+		const int MaxLevel = int(VoiceQuality::Max) - 1;
+		if(m_Stats.m_Load > m_Governor.m_HighLoad || Load > 1.f)
+		{
+			m_Stats.m_QualityLevel = std::min(m_Stats.m_QualityLevel + 1, MaxLevel);
+			m_RecoverCount = 0;
+		}
+		else if(m_Stats.m_Load < m_Governor.m_LowLoad && m_Stats.m_QualityLevel > 0)
+		{
+			if(++m_RecoverCount >= m_Governor.m_RecoverBlockNr)
+			{
+				m_Stats.m_QualityLevel--;
+				m_RecoverCount = 0;
+			}
+		}
+		else
+		{
+			m_RecoverCount = 0;
+		}
+	}
+
+	//-----------------------------------------------------
+	VoiceQuality Synth::GetVoiceQuality(float Loudness) const
+	{
+		if(!m_Governor.m_Enabled)
+			return VoiceQuality::Full;
+
+		int Quality = 0;
+		for(int i = 1; i <= m_Stats.m_QualityLevel; i++)
+			if(Loudness < m_Governor.m_LoudnessTab[i])
+				Quality = i;
+
+		return VoiceQuality(Quality);
+	}
+
+	//-----------------------------------------------------
+	void Synth::ApplyEvent(const SynthEvent & Event)
+	{
+		switch(Event.m_Type)
+		{
+		case SynthEventType::NoteOn:	NoteOn(Event.m_Channel, Event.m_KeyId, Event.m_Value); break;
+		case SynthEventType::NoteOff:	NoteOff(Event.m_Channel, Event.m_KeyId); break;
+		case SynthEventType::PitchBend:	m_PitchBend = Event.m_Value; break;
+		}
+	}
+
+	//-----------------------------------------------------
+	void Synth::BindSource(SoundSource & NewSource, const KeyZone & Zone)
+	{
+		SYNTHOX_RT_FORBIDDEN();
+		assert(m_SourceTab.size() < SynthMaxSourceNr);
+
+		NewSource.OnBound(this);
+		m_SourceTab.push_back(&NewSource);
+		if(std::find(m_DestTab.begin(), m_DestTab.end(), &NewSource.GetDest()) == m_DestTab.end())
+			m_DestTab.push_back(&NewSource.GetDest());
+
+		RouteSource(NewSource, NewSource.GetChannel(), Zone);
+	}
+
+	//-----------------------------------------------------
+	void Synth::RouteSource(SoundSource & Source, int Channel, const KeyZone & Zone)
+	{
+		SYNTHOX_RT_FORBIDDEN();
+
+		// out of range channels are never routed
+		if(Channel < 0 || Channel >= SynthChannelNr)
+			return;
+
+		m_RouteTab[Channel].push_back({ &Source, Zone });
+	}
+
+	//-----------------------------------------------------
+	// renders straight into caller storage, clamped as PopOutputVal does
+	void Synth::Render(std::span<std::pair<float, float>> Dest)
+	{
+		SYNTHOX_RT_SCOPE();
+
+		for(size_t Done = 0; Done < Dest.size(); )
+		{
+			const unsigned int SampleNr = (unsigned int)std::min<size_t>(Dest.size() - Done, m_OutBuf.m_Data.size());
+			Render(SampleNr);
+
+			for(unsigned int i = 0; i < SampleNr; i++)
+			{
+				auto & [Left, Right] = Dest[Done + i];
+				PopOutputVal(Left, Right);
+			}
+
+			Done += SampleNr;
+		}
 	}
 
 	//-----------------------------------------------------
@@ -108,15 +420,67 @@ namespace SynthOX
 	//-----------------------------------------------------
 	void Synth::NoteOn(int _Channel, int _KeyId, float _Velocity)
 	{
-		for(auto & Source : m_SourceTab)
-			Source->NoteOn(_Channel, _KeyId, _Velocity);
+		SYNTHOX_RT_SCOPE();
+		DenormalGuard Guard(m_FlushDenormals);
+
+		if(_Channel < 0 || _Channel >= SynthChannelNr)
+			return;
+
+		for(const auto & Route : m_RouteTab[_Channel])
+			if(Route.m_Zone.Contains(_KeyId, _Velocity))
+				Route.m_Source->NoteOn(_KeyId, _Velocity);
 	}
 
 	//-----------------------------------------------------
 	void Synth::NoteOff(int _Channel, int _KeyId)
 	{
-		for(auto & Source : m_SourceTab)
-			Source->NoteOff(_Channel, _KeyId);
+		SYNTHOX_RT_SCOPE();
+		DenormalGuard Guard(m_FlushDenormals);
+
+		if(_Channel < 0 || _Channel >= SynthChannelNr)
+			return;
+
+		// every velocity layer of the key range : the note may have been taken by any of them,
+		// and sources ignore note offs for keys they do not hold
+		for(const auto & Route : m_RouteTab[_Channel])
+			if(Route.m_Zone.ContainsKey(_KeyId))
+				Route.m_Source->NoteOff(_KeyId);
 	}
 
 };
+
+#ifdef SYNTHOX_RT_AUDIT
+//-----------------------------------------------------
+// global allocator hooks, trap any heap traffic inside a render scope
+void * operator new(std::size_t Size)
+{
+	SynthOX::RTAudit::Check(!SynthOX::RTAudit::IsInRender());
+	if(void * Ptr = std::malloc(Size))
+		return Ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void * Ptr) noexcept
+{
+	SynthOX::RTAudit::Check(Ptr == nullptr || !SynthOX::RTAudit::IsInRender());
+	std::free(Ptr);
+}
+
+void operator delete(void * Ptr, std::size_t) noexcept { operator delete(Ptr); }
+
+#if defined(__GLIBC__)
+#include <dlfcn.h>
+#include <pthread.h>
+
+//-----------------------------------------------------
+// lock hook, std::mutex and friends end up here : a render scope must never wait on another thread
+extern "C" int pthread_mutex_lock(pthread_mutex_t * Mutex)
+{
+	using LockFunc = int (*)(pthread_mutex_t *);
+	static const LockFunc RealLock = reinterpret_cast<LockFunc>(dlsym(RTLD_NEXT, "pthread_mutex_lock"));
+
+	SynthOX::RTAudit::Check(!SynthOX::RTAudit::IsInRender());
+	return RealLock(Mutex);
+}
+#endif
+#endif
@@ -6,6 +6,13 @@
 #include <array>
 #include <utility>
 #include <map>
+#include <span>
+#include <atomic>
+#include <limits>
+#include <assert.h>
+#include <thread>
+#include <string>
+#include <cmath>
 
 namespace SynthOX
 {
@@ -48,15 +55,94 @@ namespace SynthOX
 		Portamento,
 	};
 
+	enum class SynthEventType : char
+	{
+		NoteOn,
+		NoteOff,
+		PitchBend,
+	};
+
+	// degradation steps applied by the quality governor, each one includes the previous ones
+	enum class VoiceQuality : char
+	{
+		Full,
+		CoarseModulation,
+		SinglePassFilter,
+		CheapWaveform,
+		Drop,
+		Max,
+	};
+
+	static const int SynthMaxSourceNr = 64;
+	static const int SynthChannelNr = 16;
+	static const int AsyncEventQueueSize = 1024;
+	static const int AsyncMaxAheadBlockNr = 16;
+	static const unsigned int SynthEngineVersion = 5;	// bump whenever the render kernels change their output
+	static const long OfflineChunkLength = 1 << 16;
+	static const long OfflineBlockLength = 256;
+
 	extern float OctaveFreq[];
 	class Synth;
 
+	static const float DenormalThreshold = 1e-20f;
+
 	void FloatClear(float * Dest, long len);
-	float Distortion(float _Gain, float _Sample);
+	bool FlushDenormal(float & Val, bool bFlush = true);
 	float GetNoteFreq(float _NoteCode);
 	float GetWaveformValue(WaveType Type, float Cursor);
+	float FillWaveform(WaveType Type, float Phase, float PhaseInc, std::span<float> Dest, bool bBandLimited = false);
+
+	// inline : both run per sample and per unison lane, in loops that must stay vectorizable
+	inline float Distortion(float _Gain, float _Sample)
+	{
+		_Sample *= 1.0f + _Gain;
+		return 1.5f*_Sample - 0.5f*_Sample*_Sample*_Sample;
+	}
+
+	inline float Transfer(float x, float Alpha)
+	{
+		return x < .5f ? .5f - .5f * std::powf(1.f - 2.f*x, Alpha) : .5f + .5f * std::powf(2.f*x - 1.f, Alpha);
+	}
 
 	//_________________________________________________
+	// Realtime safety audit : build with SYNTHOX_RT_AUDIT to trap heap allocations, mutex locks (glibc) and setup calls made on the render path
+	namespace RTAudit
+	{
+		extern thread_local int gRenderDepth;
+		inline std::atomic<unsigned int> gViolationNr = 0;
+
+		struct RenderScope
+		{
+			RenderScope()	{ gRenderDepth++; }
+			~RenderScope()	{ gRenderDepth--; }
+		};
+
+		inline bool IsInRender() { return gRenderDepth > 0; }
+		inline void Check(bool bAllowed) { if(!bAllowed) gViolationNr++; assert(bAllowed && "not allowed on the render thread"); }
+	};
+
+#ifdef SYNTHOX_RT_AUDIT
+	#define SYNTHOX_RT_SCOPE()		SynthOX::RTAudit::RenderScope RTAuditScope
+	#define SYNTHOX_RT_FORBIDDEN()	SynthOX::RTAudit::Check(!SynthOX::RTAudit::IsInRender())
+#else
+	#define SYNTHOX_RT_SCOPE()
+	#define SYNTHOX_RT_FORBIDDEN()
+#endif
+
+	//_________________________________________________
+	// flush-to-zero / denormals-are-zero for the lifetime of the scope (x86 only, no-op elsewhere)
+	class DenormalGuard
+	{
+		unsigned int	m_SavedCSR = 0;
+		bool			m_Active = false;
+
+	public:
+		DenormalGuard(bool Enable);
+		~DenormalGuard();
+	};
+
+	//_________________________________________________
+	// storage is sized once at construction, never on the render path
 	template <class DataType = float, size_t Size = 16>
 	struct SoundBuf
 	{
@@ -68,12 +154,14 @@ namespace SynthOX
 
 	struct StereoSoundBuf : SoundBuf<std::pair<float, float>, PlaybackFreq>
 	{
+		// sources mix into the NbSamples ahead of the write cursor, the consumer moves it
 		void Clear(long NbSamples)
 		{
+			long Cursor = m_WriteCursor;
 			for(int i = 0; i < NbSamples; i++)
 			{
-				m_Data[m_WriteCursor] = {0.f, 0.f};
-				m_WriteCursor = (m_WriteCursor + 1) % PlaybackFreq;
+				m_Data[Cursor] = {0.f, 0.f};
+				Cursor = (Cursor + 1) % PlaybackFreq;
 			}
 		}
 	};
@@ -92,6 +180,7 @@ namespace SynthOX
 	public:
 		SoundSource(StereoSoundBuf * Dest, int Channel) : m_Dest(Dest), m_Channel(Channel) {}
 		virtual void OnBound(Synth * Synth) { m_Synth = Synth; }
+		int GetChannel() const { return m_Channel; }
 
 		virtual void NoteOn(int _Channel, int _KeyId, float _Velocity)
 		{
@@ -179,6 +268,8 @@ namespace SynthOX
 		float				m_BaseValue = 1.f;
 		WaveType			m_WF = WaveType::Sine;
 		char				m_NoteSync = 0;
+
+		bool operator==(const LFOData &) const = default;
 	};
 
 	//_________________________________________________
@@ -190,7 +281,8 @@ namespace SynthOX
 		LFOData	*	m_Data = nullptr;
 		bool		m_ZeroCentered = false;
 
-		float GetUpdatedValue(float NoteTime);
+		float GetUpdatedValue(float NoteTime, int SampleNr = 1);
+		void GetUpdatedValues(float NoteTime, std::span<float> Dest, int SampleNr = 1);
 		void NoteOn();
 	};
 
@@ -201,10 +293,19 @@ namespace SynthOX
 		char			m_OctaveOffset = 0;
 		char			m_NoteOffset = 0;	
 		ModulationType	m_ModulationType = ModulationType::Mul;
+		char			m_UnisonNr = 1;			// stacked copies, up to UnisonMaxNr
+		float			m_UnisonDetune = 0.f;	// semitones between the outermost copies and the center
+		float			m_UnisonSpread = 0.f;	// stereo spread of the copies [0..1]
+
+		bool operator==(const OscillatorData &) const = default;
 	};
 
 	static const int AnalogsourceOscillatorNr = 2;
 	static const int AnalogsourcePolyphonyNoteNr = 6;
+	static const int UnisonMaxNr = 16;
+	static const int PitchRampLength = 32;
+	static const int ModulationDecimation = 8;
+	static const int ModulationBlockLength = 32;	// LFOs are evaluated a block at a time
 
 	struct ADSRData
 	{
@@ -212,6 +313,8 @@ namespace SynthOX
 		float		m_Decay = 0.f;
 		float		m_Sustain = 0.f;
 		float		m_Release = 0.f;
+
+		bool operator==(const ADSRData &) const = default;
 	};
 
 	//_________________________________________________
@@ -229,8 +332,15 @@ namespace SynthOX
 		float					m_PortamentoTime = 0.f;
 		float					m_ArpeggioPeriod = .1f;
 		PolyphonyMode			m_PolyphonyMode = PolyphonyMode::Poly;
+
+		bool operator==(const AnalogSourceData &) const = default;
 	};
 
+	static const int NoteCacheCheckpointPeriod = 256;
+	static const long NoteCacheMaxLength = PlaybackFreq * 2;
+	static const long NoteCacheCheckpointNr = NoteCacheMaxLength / NoteCacheCheckpointPeriod + 1;
+	static const size_t NoteCacheDefaultBudget = 16 * 1024 * 1024;
+
 	//_________________________________________________
 	class AnalogSource : public SoundSource
 	{
@@ -239,15 +349,29 @@ namespace SynthOX
 			LFOTransients	m_LFOTab[int(LFODest::Max)];
 			float			m_Cursor = 0.f;
 			float			m_PrevVal = 0.f;
+			float			m_PrevValR = 0.f;	// right channel of spread unison stacks
+
+			// phase increments, ramped towards the pitch target every PitchRampLength samples
+			float			m_FreqInc = 0.f;
+			float			m_FreqIncRatio = 1.f;	// per sample, the ramp is linear in log-frequency
+			float			m_ShiftInc = 0.f;	// Tune LFO, in Hz as well
+			float			m_ShiftIncStep = 0.f;
+
+			// modulation, held between updates in VoiceQuality::CoarseModulation
+			float			m_Volume = 0.f;
+			float			m_DistortGain = 0.f;
+			float			m_ShapeC = 0.f;
+			float			m_Flatness = 0.f;
+			float			m_Decat = 0.f;
+
+			alignas(16) float	m_UnisonCursorTab[UnisonMaxNr] = {};
+
+			// LFO values of the current modulation block, Tune aside (it follows the pitch ramps)
+			float			m_LFOBlock[int(LFODest::Max) - 1][ModulationBlockLength] = {};
 		};
 
-		struct AnalogSourceNote : Note
+		struct LadderState
 		{
-			OscillatorTransients	m_OscillatorTab[AnalogsourceOscillatorNr];
-			float					m_AmpADSRValue = 0.f;
-			float					m_FilterADSRValue = 0.f;
-			
-			// filter stuff
 			float az1 = 0.f;
 			float az2 = 0.f;
 			float az3 = 0.f;
@@ -258,14 +382,116 @@ namespace SynthOX
 			float ay3 = 0.f;
 			float ay4 = 0.f;
 			float amf = 0.f;
+
+			int FlushDenormals(bool bFlush);
+		};
+
+		struct VoiceState
+		{
+			OscillatorTransients	m_OscillatorTab[AnalogsourceOscillatorNr];
+
+			// filter stuff
+			LadderState				m_Filter;
+			LadderState				m_SideFilter;	// stereo unison only, filtered as mid/side
+
+			int						m_PitchRampPos = 0;
+			int						m_ModulationPos = 0;	// in the modulation block
+			int						m_ModulationStep = 1;	// samples between two values of the modulation block
+			bool					m_bPitchSnap = true;	// jump to the next target instead of gliding
+
+			void Reset();
+			void RestartPitch();
+			void ClearTails();
+			int FlushDenormals(bool bFlush);
+		};
+
+		// pre-rendered note : voice output before the amp envelope, plus voice state snapshots to resume live rendering
+		struct NoteCacheEntry
+		{
+			struct Checkpoint
+			{
+				VoiceState	m_State;
+				float		m_Time = 0.f;
+			};
+
+			float *			m_Samples = nullptr;		// NoteCacheMaxLength samples
+			Checkpoint *	m_Checkpoints = nullptr;	// NoteCacheCheckpointNr snapshots
+			long			m_Length = 0;
+			int				m_KeyId = -1;
+			unsigned int	m_LastUse = 0;
+			bool			m_Complete = false;
+		};
+
+		struct AnalogSourceNote : Note, VoiceState
+		{
+			float					m_AmpADSRValue = 0.f;
+			float					m_FilterADSRValue = 0.f;
+			float					m_Loudness = 0.f;
+			VoiceQuality			m_Quality = VoiceQuality::Full;
+
+			// note cache playback/recording
+			NoteCacheEntry *		m_CacheEntry = nullptr;
+			long					m_CacheIdx = 0;
+			bool					m_CacheRecording = false;
+		};
+
+		// unison setup shared by all the voices, rebuilt when the oscillator's unison settings change
+		struct UnisonLanes
+		{
+			alignas(16) float	m_RatioTab[UnisonMaxNr];
+			alignas(16) float	m_LeftGainTab[UnisonMaxNr];
+			alignas(16) float	m_RightGainTab[UnisonMaxNr];
+			float				m_Norm = 1.f;
+			int					m_Nr = 1;
+			bool				m_bStereo = false;
+
+			// settings the tables were built from, m_DataNr = 0 until the first build
+			int					m_DataNr = 0;
+			float				m_DataDetune = 0.f;
+			float				m_DataSpread = 0.f;
 		};
 
+		UnisonLanes				m_UnisonTab[AnalogsourceOscillatorNr];
+		bool					m_bStereoVoices = false;
+
 		float					m_PortamentoBaseNote = 0.f;
 		float					m_PortamentoStep = 0.f;
 		int						m_ArpeggioIdx = 0;
 		float					m_ArpeggioTime = .0f;
 
+		// note cache slots, allocated up front by EnableNoteCache
+		std::vector<NoteCacheEntry>				m_NoteCache;
+		std::vector<float>						m_NoteCacheSamples;
+		std::vector<NoteCacheEntry::Checkpoint>	m_NoteCacheCheckpoints;
+		AnalogSourceData						m_NoteCacheData;
+		unsigned int							m_NoteCacheClock = 0;
+		bool									m_NoteCacheEnabled = false;
+		bool									m_NoteCacheable = false;
+
+		void BindNoteData(AnalogSourceNote & Note);
+		void UpdateUnisonLanes();
+		static void BuildUnisonLanes(UnisonLanes & Lanes, int Nr, float Detune, float Spread);
+		std::pair<float, float> RenderUnisonLanes(OscillatorTransients & Oscillator, const UnisonLanes & Lanes, bool bCheapWaveform) const;
+		void UpdatePitchRamp(AnalogSourceNote & Note, float TargetNote);
+		std::pair<float, float> RenderVoice(AnalogSourceNote & Note, float BaseNote);
+		bool IsNoteCacheable() const;
+		void UpdateNoteCache();
+		void AttachNoteCache(AnalogSourceNote & Note);
+		void DetachNoteCache(AnalogSourceNote & Note, bool bResume = true);
+		float RenderCachedVoice(AnalogSourceNote & Note);
+		NoteCacheEntry * FindNoteCacheSlot(int KeyId);
+
 	public:
+		// render state between two blocks, plain data so that offline bounces can store it and resume from it
+		struct RenderState
+		{
+			AnalogSourceNote	m_NoteTab[AnalogsourcePolyphonyNoteNr];
+			float				m_PortamentoBaseNote;
+			float				m_PortamentoStep;
+			int					m_ArpeggioIdx;
+			float				m_ArpeggioTime;
+		};
+
 		AnalogSourceData		* m_Data;
 		AnalogSourceNote		m_NoteTab[AnalogsourcePolyphonyNoteNr];
 
@@ -274,26 +500,215 @@ namespace SynthOX
 		void NoteOn(int KeyId, float Velocity) override;
 		void NoteOff(int KeyId) override;
 		std::vector<float> RenderScope(int OscIdx, unsigned int NbSamples);
+		void RenderScope(int OscIdx, std::span<float> Dest);
+		void RenderLFOScope(int OscIdx, LFODest LFO, std::span<float> Dest) const;
+		void EnableNoteCache(bool Enable, size_t ByteBudget = NoteCacheDefaultBudget);
+		void ClearNoteCache();
+		void SaveRenderState(RenderState & State) const;
+		void LoadRenderState(const RenderState & State);
 		void Render(long SampleNr) override;
 		float GetADSRValue(AnalogSourceNote & Note, const float & SavedValue, const ADSRData & Data) const;
-		float ResoFilter(AnalogSourceNote & InNote, float input, float cutoff, float resonance);
+		float ResoFilter(LadderState & Ladder, float input, float cutoff, float resonance, int PassNr = 2);
+	};
+
+	//_________________________________________________
+	struct SynthStats
+	{
+		unsigned int	m_SubnormalNr = 0;		// subnormal values found in decaying DSP state
+		unsigned int	m_DroppedVoiceNr = 0;	// released voices cut short by the governor
+		float			m_Load = 0.f;			// smoothed render time / real time
+		int				m_QualityLevel = 0;		// active governor degradation steps
+	};
+
+	//_________________________________________________
+	// adaptive quality : under CPU pressure the least audible voices get degraded step by step
+	struct GovernorData
+	{
+		bool		m_Enabled = false;
+		float		m_HighLoad = .75f;		// degrade one more step above this load
+		float		m_LowLoad = .5f;		// recover one step below this load...
+		int			m_RecoverBlockNr = 16;	// ...held for that many blocks
+		float		m_LoudnessTab[int(VoiceQuality::Max)] = { 1.f, .5f, .25f, .1f, .03f };	// voices under this loudness get the step
+	};
+
+	//_________________________________________________
+	// key / velocity split of a source on a channel
+	struct KeyZone
+	{
+		int		m_KeyLow = std::numeric_limits<int>::min();
+		int		m_KeyHigh = std::numeric_limits<int>::max();
+		float	m_VelocityLow = -std::numeric_limits<float>::max();
+		float	m_VelocityHigh = std::numeric_limits<float>::max();
+
+		bool ContainsKey(int KeyId) const { return KeyId >= m_KeyLow && KeyId <= m_KeyHigh; }
+		bool Contains(int KeyId, float Velocity) const { return ContainsKey(KeyId) && Velocity >= m_VelocityLow && Velocity <= m_VelocityHigh; }
+	};
+
+	//_________________________________________________
+	struct SynthEvent
+	{
+		unsigned long long	m_SamplePos = 0;	// absolute position in the rendered stream
+		SynthEventType		m_Type = SynthEventType::NoteOn;
+		int					m_Channel = 0;
+		int					m_KeyId = 0;
+		float				m_Value = 0.f;		// velocity or pitch bend
 	};
 
 	//_________________________________________________
 	class Synth
 	{
+		struct SourceRoute
+		{
+			SoundSource *	m_Source;
+			KeyZone			m_Zone;
+		};
+
 		std::vector<SoundSource*>					m_SourceTab;
+		std::vector<StereoSoundBuf*>				m_DestTab;			// distinct source destinations
+		std::array<std::vector<SourceRoute>, SynthChannelNr>	m_RouteTab;			// per channel, layered sources in bind order
+		int											m_RecoverCount = 0;
+
+		void UpdateGovernor(float RenderTime, unsigned int SamplesRendered);
 
 	public:
 		StereoSoundBuf								m_OutBuf;
+		SynthStats									m_Stats;
 
 		float m_PitchBend = 0.f;
+		bool m_FlushDenormals = true;
+		GovernorData m_Governor;
+
+		Synth() { m_SourceTab.reserve(SynthMaxSourceNr); m_DestTab.reserve(SynthMaxSourceNr); }
+
+		VoiceQuality GetVoiceQuality(float Loudness) const;
 
 		void Render(unsigned int SamplesToRender);
+		void Render(std::span<std::pair<float, float>> Dest);
 		void NoteOn(int Channel, int KeyId, float Velocity);
 		void NoteOff(int Channel, int KeyId);
-		void BindSource(SoundSource & NewSource) { NewSource.OnBound(this); m_SourceTab.push_back(&NewSource); }
+		void ApplyEvent(const SynthEvent & Event);
+		void BindSource(SoundSource & NewSource, const KeyZone & Zone = {});
+		void RouteSource(SoundSource & Source, int Channel, const KeyZone & Zone = {});
 		void PopOutputVal(float & OutLeft, float & OutRight);
 	};
 
+	//_________________________________________________
+	// lock-free single producer / single consumer ring
+	template <class T, size_t Size>
+	class SPSCQueue
+	{
+		std::array<T, Size>		m_Data;
+		std::atomic<size_t>		m_Head = 0;	// next read
+		std::atomic<size_t>		m_Tail = 0;	// next write
+
+	public:
+		bool Push(const T & Val)
+		{
+			const size_t Tail = m_Tail.load(std::memory_order_relaxed);
+			if(Tail - m_Head.load(std::memory_order_acquire) == Size)
+				return false;
+
+			m_Data[Tail % Size] = Val;
+			m_Tail.store(Tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		const T * Peek() const
+		{
+			const size_t Head = m_Head.load(std::memory_order_relaxed);
+			return Head == m_Tail.load(std::memory_order_acquire) ? nullptr : &m_Data[Head % Size];
+		}
+
+		void Pop() { m_Head.store(m_Head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+	};
+
+	//_________________________________________________
+	// Render-ahead : a dedicated thread keeps AheadBlockNr blocks of the Synth output ready.
+	// Events are posted with their target sample position (events must be posted in time order,
+	// late ones are applied at the start of the next rendered block), the audio callback only dequeues blocks.
+	class AsyncRenderer
+	{
+		Synth &									m_Synth;
+		SPSCQueue<SynthEvent, AsyncEventQueueSize>	m_EventQueue;
+		std::vector<std::pair<float, float>>	m_BlockData;
+		std::atomic<unsigned long long>			m_WrittenBlockNr = 0;
+		std::atomic<unsigned long long>			m_ReadBlockNr = 0;
+		std::atomic<unsigned int>				m_WakeNr = 0;
+		unsigned long long						m_RenderedSampleNr = 0;
+		unsigned int							m_BlockSize;
+		int										m_AheadBlockNr;
+		std::thread								m_Thread;
+		std::atomic<bool>						m_Running = false;
+
+		void ThreadFunc();
+		void RenderBlock(std::pair<float, float> * Dest);
+
+	public:
+		AsyncRenderer(Synth & Synth, unsigned int BlockSize, int AheadBlockNr);
+		~AsyncRenderer() { Stop(); }
+
+		void Start();
+		void Stop();
+		bool PostEvent(const SynthEvent & Event) { return m_EventQueue.Push(Event); }
+		bool PostNoteOn(unsigned long long SamplePos, int Channel, int KeyId, float Velocity) { return PostEvent({ SamplePos, SynthEventType::NoteOn, Channel, KeyId, Velocity }); }
+		bool PostNoteOff(unsigned long long SamplePos, int Channel, int KeyId) { return PostEvent({ SamplePos, SynthEventType::NoteOff, Channel, KeyId, 0.f }); }
+		bool PostPitchBend(unsigned long long SamplePos, float PitchBend) { return PostEvent({ SamplePos, SynthEventType::PitchBend, 0, 0, PitchBend }); }
+		bool PopBlock(std::span<std::pair<float, float>> Dest);
+
+		unsigned int GetBlockSize() const { return m_BlockSize; }
+		unsigned long long GetLatency() const { return (unsigned long long)m_BlockSize * m_AheadBlockNr; }
+		unsigned long long GetPlayedSampleNr() const { return m_ReadBlockNr.load() * m_BlockSize; }
+	};
+
+	//_________________________________________________
+	struct OfflineStats
+	{
+		int		m_ReusedChunkNr = 0;
+		int		m_RenderedChunkNr = 0;
+		int		m_RenderedStemNr = 0;
+		int		m_PrerollChunkNr = 0;		// clean chunks rendered again to rebuild the voice state of a dirty one
+	};
+
+	//_________________________________________________
+	// Offline bounce : every source is rendered alone into a stem, cut into OfflineChunkLength chunks stored on disk
+	// under the hash of all they depend on (engine version, sample rate, patch, routing and the events up to the chunk end).
+	// Stems whose chunks are all found are read back, only the dirty ones get rendered before the mix.
+	// Each chunk also stores the stem render state at its end, a dirty stem resumes from the last clean chunk before it.
+	class OfflineRenderer
+	{
+		struct Stem
+		{
+			AnalogSourceData *			m_Data;
+			int							m_Channel;
+			KeyZone						m_Zone;
+		};
+
+		struct StemState
+		{
+			float						m_PitchBend = 0.f;
+			AnalogSource::RenderState	m_Source;
+		};
+
+		std::string							m_CacheDir;
+		std::vector<Stem>					m_StemTab;
+		std::vector<SynthEvent>				m_EventTab;
+
+		void RenderStem(const Stem & Stem, unsigned long long Start, unsigned long long End, std::vector<std::pair<float, float>> & Mix);
+		bool LoadChunk(unsigned long long Key, std::vector<std::pair<float, float>> & Chunk) const;
+		bool LoadChunkState(unsigned long long Key, StemState & State) const;
+		void StoreChunk(unsigned long long Key, const std::vector<std::pair<float, float>> & Chunk, const StemState & State) const;
+		std::string GetChunkPath(unsigned long long Key) const;
+
+	public:
+		OfflineStats						m_Stats;
+
+		explicit OfflineRenderer(const std::string & CacheDir);
+
+		void AddSource(AnalogSourceData & Data, int Channel, const KeyZone & Zone = {});
+		void SetEvents(std::span<const SynthEvent> Events);
+
+		// mix of the [Start, End) sample range, dirty chunks are rendered from the last clean one
+		void Render(unsigned long long Start, unsigned long long End, std::vector<std::pair<float, float>> & Out);
+	};
+
 }; // namespace SynthOX
@@ -15,12 +15,13 @@ int main()
 	Synth.NoteOff(0, 10);
 	Synth.Render(255);
 
+	std::vector<float> Scope(44000);
 	for(int i = 0; i < 100; i++)
 	{
 		float L, R;
 		for(int i = 0; i < 255+255; i++)
 			Synth.PopOutputVal(L, R);
 
-		auto Scope = AnalogSource0.RenderScope(0, 44000);
+		AnalogSource0.RenderScope(0, Scope);
 	}
 }